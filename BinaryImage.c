@@ -0,0 +1,298 @@
+#include "BinaryImage.h"
+#include "Distance.h"
+#include "Scratch.h"
+#include "utils.h"
+
+void BinaryImage_create(BinaryImage *bin, int width, int height) {
+    bin->words = (width + 63) / 64;
+    bin->data = calloc((size_t)bin->words * height, sizeof(uint64_t));
+    ON_ERROR_EXIT(bin->data == NULL && bin->words * height != 0, "Error in creating the binary image");
+    bin->width = width;
+    bin->height = height;
+}
+
+void BinaryImage_free(BinaryImage *bin) {
+    free(bin->data);
+    bin->data = NULL;
+    bin->width = 0;
+    bin->height = 0;
+    bin->words = 0;
+}
+
+void BinaryImage_from_image(const Image *orig, BinaryImage *bin) {
+    BinaryImage_create(bin, orig->width, orig->height);
+
+    for(int y = 0; y < orig->height; ++y) {
+        const uint8_t *p = orig->data + (size_t)y * orig->stride;
+        uint64_t *row = bin->data + (size_t)y * bin->words;
+        for(int x = 0; x < orig->width; ++x, p += orig->channels) {
+            row[x / 64] |= (uint64_t)(*p >= 128) << (x % 64);
+        }
+    }
+}
+
+void BinaryImage_to_image(const BinaryImage *bin, Image *img) {
+    Image_create(img, bin->width, bin->height, 1, false);
+    ON_ERROR_EXIT(img->data == NULL, "Error in creating the image");
+
+    for(int y = 0; y < bin->height; ++y) {
+        uint8_t *p = img->data + (size_t)y * img->stride;
+        const uint64_t *row = bin->data + (size_t)y * bin->words;
+        for(int x = 0; x < bin->width; ++x) {
+            *p++ = (row[x / 64] >> (x % 64)) & 1 ? 255 : 0;
+        }
+    }
+}
+
+void BinaryImage_from_tophat(const Image *orig, BinaryImage *bin, int r, int t) {
+    Plane luma;
+    Image_get_luma_scratch(orig, &luma);
+    BinaryImage_from_luma_tophat(&luma, bin, r, t);
+}
+
+void BinaryImage_from_luma_tophat(const Plane *luma, BinaryImage *bin, int r, int t) {
+    BinaryImage_create(bin, luma->width, luma->height);
+    Morph_tophat_threshold_bits(luma, bin->data, bin->words, StructElem_disc(r, DISC_EXACT), t);
+}
+
+// Rows of the bands of BinaryImage_from_stream_tophat
+#define STREAM_BAND_HEIGHT 128
+
+typedef struct {
+    BinaryImage *bin;
+    const StructElem *se;
+    int t;
+} StreamTophat;
+
+// The top-hat of a band and its halos, of which only the rows of the band are kept
+static void stream_tophat_band(const MorphTile *tile, void *arg) {
+    const StreamTophat *run = arg;
+    int words = run->bin->words;
+    uint64_t *bits = Scratch_get(SCRATCH_STREAM_BITS, (size_t)tile->in.height * words * sizeof(uint64_t));
+    Morph_tophat_threshold_bits(&tile->in, bits, words, run->se, run->t);
+    memcpy(run->bin->data + (size_t)tile->y * words, bits + (size_t)(tile->y - tile->in_y) * words,
+        (size_t)tile->height * words * sizeof(uint64_t));
+}
+
+void BinaryImage_from_stream_tophat(ImageStream *stream, BinaryImage *bin, int r, int t) {
+    BinaryImage_create(bin, stream->width, stream->height);
+    StreamTophat run = {bin, StructElem_disc(r, DISC_EXACT), t};
+    // The opening reaches twice as far as its element
+    int reach = run.se->top > run.se->bottom ? run.se->top : run.se->bottom;
+    ImageStream_bands(stream, STREAM_BAND_HEIGHT, 2 * reach, stream_tophat_band, &run);
+}
+
+// Mask of the bits holding pixels in the last word of a row
+static uint64_t last_word_mask(int width) {
+    return width % 64 ? ((uint64_t)1 << (width % 64)) - 1 : ~(uint64_t)0;
+}
+
+// dst[x] = src[x - s] for the pixels of one row, `fill` for pixels coming from outside the row
+static uint64_t shifted_word(const uint64_t *src, int words, int i, int s, uint64_t fill) {
+    int offset = s >= 0 ? s / 64 : -((-s + 63) / 64);
+    int bits = s - offset * 64;
+    int lo = i - offset;
+    int hi = lo - 1;
+    uint64_t lo_word = lo >= 0 && lo < words ? src[lo] : fill;
+    if(bits == 0) {
+        return lo_word;
+    }
+    uint64_t hi_word = hi >= 0 && hi < words ? src[hi] : fill;
+    return (lo_word << bits) | (hi_word >> (64 - bits));
+}
+
+// AND (erosion) or OR (dilation) over the disc of radius r
+static void BinaryImage_disc(const BinaryImage *src, BinaryImage *dst, int r, bool erode) {
+    int words = src->words;
+    uint64_t fill = erode ? ~(uint64_t)0 : 0;
+    uint64_t last = last_word_mask(src->width);
+
+    // Half width of each row of the disc
+    int *half = Scratch_get(SCRATCH_DISC, (2 * r + 1) * sizeof(int));
+    // One input row, with the bits past the width set to the fill value
+    uint64_t *row = Scratch_get(SCRATCH_DISC_ROW, (words + 1) * sizeof(uint64_t));
+    BinaryImage result;
+    BinaryImage_create(&result, src->width, src->height);
+    for(int dy = -r; dy <= r; ++dy) {
+        int x = 0;
+        while((x + 1) * (x + 1) + dy * dy <= r * r) {
+            ++x;
+        }
+        half[dy + r] = x;
+    }
+
+    for(int y = 0; y < src->height; ++y) {
+        uint64_t *out = result.data + (size_t)y * words;
+        for(int i = 0; i < words; ++i) {
+            out[i] = fill;
+        }
+
+        for(int dy = -r; dy <= r; ++dy) {
+            if(y + dy < 0 || y + dy >= src->height || words == 0) {
+                continue;
+            }
+            memcpy(row, src->data + (size_t)(y + dy) * words, words * sizeof(uint64_t));
+            row[words - 1] = (row[words - 1] & last) | (fill & ~last);
+
+            for(int i = 0; i < words; ++i) {
+                uint64_t acc = row[i];
+                for(int s = 1; s <= half[dy + r]; ++s) {
+                    if(erode) {
+                        acc &= shifted_word(row, words, i, s, fill) & shifted_word(row, words, i, -s, fill);
+                    } else {
+                        acc |= shifted_word(row, words, i, s, fill) | shifted_word(row, words, i, -s, fill);
+                    }
+                }
+                out[i] = erode ? out[i] & acc : out[i] | acc;
+            }
+        }
+
+        if(words > 0) {
+            out[words - 1] &= last;
+        }
+    }
+
+    *dst = result;
+}
+
+// From this radius on the distance transform, whose cost does not depend on r,
+// beats the shifts (measured on a 4000x3000 page)
+#define BINARY_EDT_RADIUS 7
+
+void BinaryImage_erode(const BinaryImage *src, BinaryImage *dst, int r) {
+    if(r < BINARY_EDT_RADIUS) {
+        BinaryImage_disc(src, dst, r, true);
+        return;
+    }
+
+    // Set unless a pixel that is not set lies within r
+    Distance_within(src, false, r, dst);
+    uint64_t last = last_word_mask(src->width);
+    for(int y = 0; y < dst->height; ++y) {
+        uint64_t *row = dst->data + (size_t)y * dst->words;
+        for(int i = 0; i < dst->words; ++i) {
+            row[i] = ~row[i];
+        }
+        if(dst->words > 0) {
+            row[dst->words - 1] &= last;
+        }
+    }
+}
+
+void BinaryImage_dilate(const BinaryImage *src, BinaryImage *dst, int r) {
+    if(r < BINARY_EDT_RADIUS) {
+        BinaryImage_disc(src, dst, r, false);
+        return;
+    }
+    Distance_within(src, true, r, dst);
+}
+
+void BinaryImage_open(const BinaryImage *src, BinaryImage *dst, int r) {
+    BinaryImage eroded;
+    BinaryImage_erode(src, &eroded, r);
+    BinaryImage_dilate(&eroded, dst, r);
+    BinaryImage_free(&eroded);
+}
+
+void BinaryImage_close(const BinaryImage *src, BinaryImage *dst, int r) {
+    BinaryImage dilated;
+    BinaryImage_dilate(src, &dilated, r);
+    BinaryImage_erode(&dilated, dst, r);
+    BinaryImage_free(&dilated);
+}
+
+long BinaryImage_count(const BinaryImage *bin) {
+    long count = 0;
+    for(size_t i = 0; i < (size_t)bin->words * bin->height; ++i) {
+        count += __builtin_popcountll(bin->data[i]);
+    }
+    return count;
+}
+
+void BinaryImage_count_rows(const BinaryImage *bin, int *counts) {
+    for(int y = 0; y < bin->height; ++y) {
+        const uint64_t *row = bin->data + (size_t)y * bin->words;
+        int count = 0;
+        for(int i = 0; i < bin->words; ++i) {
+            count += __builtin_popcountll(row[i]);
+        }
+        counts[y] = count;
+    }
+}
+
+void BinaryImage_count_columns(const BinaryImage *bin, int *counts) {
+    memset(counts, 0, (size_t)bin->width * sizeof(int));
+    for(int y = 0; y < bin->height; ++y) {
+        const uint64_t *row = bin->data + (size_t)y * bin->words;
+        for(int i = 0; i < bin->words; ++i) {
+            // Only the set bits, one at a time
+            for(uint64_t w = row[i]; w != 0; w &= w - 1) {
+                ++counts[i * 64 + __builtin_ctzll(w)];
+            }
+        }
+    }
+}
+
+// PBM has the first pixel of a byte in its high bit, the rows the first one in bit 0
+static uint8_t reverse_bits(uint8_t byte) {
+    byte = (byte & 0xf0) >> 4 | (byte & 0x0f) << 4;
+    byte = (byte & 0xcc) >> 2 | (byte & 0x33) << 2;
+    return (byte & 0xaa) >> 1 | (byte & 0x55) << 1;
+}
+
+void BinaryImage_load_pbm(BinaryImage *bin, const char *fname) {
+    bin->data = NULL;
+    FILE *file = fopen(fname, "rb");
+    if(file == NULL) {
+        return;
+    }
+
+    int width = -1, height = -1;
+    if(fgetc(file) == 'P' && fgetc(file) == '4') {
+        width = pnm_number(file);
+        height = width >= 0 ? pnm_number(file) : -1;
+    }
+    if(height < 0) {
+        fclose(file);
+        return;
+    }
+
+    BinaryImage_create(bin, width, height);
+    int bytes = (width + 7) / 8;
+    uint8_t *line = Scratch_get(SCRATCH_PBM_ROW, bytes);
+    for(int y = 0; y < height; ++y) {
+        if(fread(line, 1, bytes, file) != (size_t)bytes) {
+            BinaryImage_free(bin);
+            break;
+        }
+        uint64_t *row = bin->data + (size_t)y * bin->words;
+        for(int k = 0; k < bytes; ++k) {
+            row[k / 8] |= (uint64_t)reverse_bits(~line[k]) << (k % 8 * 8);
+        }
+        if(bin->words > 0) {
+            row[bin->words - 1] &= last_word_mask(width);
+        }
+    }
+    fclose(file);
+}
+
+void BinaryImage_save_pbm(const BinaryImage *bin, const char *fname) {
+    FILE *file = fopen(fname, "wb");
+    ON_ERROR_EXIT(file == NULL, "Error in opening the PBM file");
+
+    fprintf(file, "P4\n%d %d\n", bin->width, bin->height);
+    int bytes = (bin->width + 7) / 8;
+    uint8_t *line = Scratch_get(SCRATCH_PBM_ROW, bytes);
+    for(int y = 0; y < bin->height; ++y) {
+        const uint64_t *row = bin->data + (size_t)y * bin->words;
+        for(int k = 0; k < bytes; ++k) {
+            line[k] = reverse_bits(~(uint8_t)(row[k / 8] >> (k % 8 * 8)));
+        }
+        // The bits past the width are 0 in the row, 1 once inverted: PBM wants them 0
+        if(bin->width % 8) {
+            line[bytes - 1] &= (uint8_t)(0xff << (8 - bin->width % 8));
+        }
+        fwrite(line, 1, bytes, file);
+    }
+    ON_ERROR_EXIT(fclose(file) != 0, "Error in writing the PBM file");
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include "Image.h"
+#include "ImageStream.h"
+
+// Binary image, 64 pixels per word: pixel x of a row is bit x % 64 of word x / 64.
+// The bits past the width in the last word of each row are always 0.
+typedef struct {
+    int width;
+    int height;
+    int words;      // words per row
+    uint64_t *data;
+} BinaryImage;
+
+void BinaryImage_create(BinaryImage *bin, int width, int height);
+void BinaryImage_free(BinaryImage *bin);
+
+// Pixels whose first channel is at least 128 are set
+void BinaryImage_from_image(const Image *orig, BinaryImage *bin);
+// 1 channel image, 255 for the pixels that are set and 0 elsewhere
+void BinaryImage_to_image(const BinaryImage *bin, Image *img);
+// Read and write binary PBM (P4) files, 8 pixels per byte. A set pixel is white like
+// in BinaryImage_to_image, so it is a 0 in the file, where 1 is black. The data is
+// NULL when the file cannot be read or is not a P4 PBM.
+void BinaryImage_load_pbm(BinaryImage *bin, const char *fname);
+void BinaryImage_save_pbm(const BinaryImage *bin, const char *fname);
+// White top-hat of the luma by a disc of radius r, binarized at t, packed as it is computed
+void BinaryImage_from_tophat(const Image *orig, BinaryImage *bin, int r, int t);
+// The same from a luma plane already converted, that of a PlanarImage for instance
+void BinaryImage_from_luma_tophat(const Plane *luma, BinaryImage *bin, int r, int t);
+// The same band by band from a stream: the luma is never whole, and a PNG or PNM is
+// decoded on the side while the band before is processed. bin is created whole.
+void BinaryImage_from_stream_tophat(ImageStream *stream, BinaryImage *bin, int r, int t);
+
+// Erosion, dilation, opening and closing by the disc {(x, y) : x*x + y*y <= r*r}.
+// Small discs are computed 64 pixels at a time with shifts and AND/OR, larger ones
+// by thresholding the distance transform, in a time that does not depend on r.
+// Pixels outside the image are ignored. dst is created by the call, like the output
+// of the Image operators.
+void BinaryImage_erode(const BinaryImage *src, BinaryImage *dst, int r);
+void BinaryImage_dilate(const BinaryImage *src, BinaryImage *dst, int r);
+void BinaryImage_open(const BinaryImage *src, BinaryImage *dst, int r);
+void BinaryImage_close(const BinaryImage *src, BinaryImage *dst, int r);
+
+// Set pixels, a word at a time with popcount: in the whole image, in each of the
+// height rows, in each of the width columns (projection profiles)
+long BinaryImage_count(const BinaryImage *bin);
+void BinaryImage_count_rows(const BinaryImage *bin, int *counts);
+void BinaryImage_count_columns(const BinaryImage *bin, int *counts);
@@ -0,0 +1,179 @@
+#include "Distance.h"
+#include "Scratch.h"
+#include "utils.h"
+#include <math.h>
+
+// Vertical distances at or above this mean no target pixel in the column. It leaves
+// room to add the height of the image without wrapping.
+#define COLUMN_NONE (UINT32_MAX / 2)
+
+// Vertical distance, in pixels, from each pixel to the nearest `target` pixel of its column
+static void column_distances(const BinaryImage *bin, bool target, uint32_t *g) {
+    int width = bin->width;
+    int height = bin->height;
+    uint64_t flip = target ? 0 : ~(uint64_t)0;
+
+    // Downward, then upward keeping the nearest of both
+    for(int y = 0; y < height; ++y) {
+        const uint64_t *row = bin->data + (size_t)y * bin->words;
+        uint32_t *out = g + (size_t)y * width;
+        const uint32_t *above = y > 0 ? out - width : NULL;
+        for(int i = 0; i * 64 < width; ++i) {
+            uint64_t word = row[i] ^ flip;
+            int n = width - i * 64 < 64 ? width - i * 64 : 64;
+            for(int b = 0; b < n; ++b) {
+                int x = i * 64 + b;
+                uint32_t next = above != NULL ? above[x] + 1 : COLUMN_NONE;
+                out[x] = (word >> b) & 1 ? 0 : next;
+            }
+        }
+    }
+    for(int y = height - 2; y >= 0; --y) {
+        uint32_t *out = g + (size_t)y * width;
+        const uint32_t *below = out + width;
+        for(int x = 0; x < width; ++x) {
+            uint32_t next = below[x] + 1;
+            out[x] = next < out[x] ? next : out[x];
+        }
+    }
+}
+
+// Squared distances along one row from the vertical ones: the lower envelope of the
+// parabolas (x - q)^2 + g[q]^2. v holds the parabolas of the envelope, z the
+// boundaries between them, both with room for width entries.
+static void row_distances(const uint32_t *g, int width, uint32_t *dist, int *v, int64_t *z) {
+    int k = -1;
+    for(int q = 0; q < width; ++q) {
+        if(g[q] >= COLUMN_NONE) {
+            continue;
+        }
+        int64_t fq = (int64_t)g[q] * g[q] + (int64_t)q * q;
+        int64_t s = 0;
+        while(k >= 0) {
+            int p = v[k];
+            int64_t fp = (int64_t)g[p] * g[p] + (int64_t)p * p;
+            // First x where the parabola of q is below the one of p, rounded up
+            int64_t num = fq - fp;
+            int64_t den = 2 * (int64_t)(q - p);
+            s = num >= 0 ? (num + den - 1) / den : -((-num) / den);
+            if(s > z[k]) {
+                break;
+            }
+            --k;
+        }
+        ++k;
+        v[k] = q;
+        z[k] = k == 0 ? INT64_MIN : s;
+    }
+
+    if(k < 0) {
+        for(int x = 0; x < width; ++x) {
+            dist[x] = DISTANCE_INFINITE;
+        }
+        return;
+    }
+
+    int j = 0;
+    for(int x = 0; x < width; ++x) {
+        while(j < k && z[j + 1] <= x) {
+            ++j;
+        }
+        int64_t d = (int64_t)(x - v[j]) * (x - v[j]) + (int64_t)g[v[j]] * g[v[j]];
+        dist[x] = d < DISTANCE_INFINITE ? (uint32_t)d : DISTANCE_INFINITE - 1;
+    }
+}
+
+// Runs the transform and hands each finished row to `row_done`
+static void distance_rows(const BinaryImage *bin, bool target, void (*row_done)(int y, const uint32_t *dist, void *arg), void *arg) {
+    int width = bin->width;
+    uint32_t *g = Scratch_get(SCRATCH_DISTANCE, (size_t)width * bin->height * sizeof(uint32_t));
+    uint32_t *row = Scratch_get(SCRATCH_DISTANCE_ROW, width * sizeof(uint32_t));
+    int *v = Scratch_get(SCRATCH_DISTANCE_V, width * sizeof(int));
+    int64_t *z = Scratch_get(SCRATCH_DISTANCE_Z, width * sizeof(int64_t));
+
+    column_distances(bin, target, g);
+    for(int y = 0; y < bin->height; ++y) {
+        row_distances(g + (size_t)y * width, width, row, v, z);
+        row_done(y, row, arg);
+    }
+}
+
+typedef struct {
+    int width;
+    uint32_t *dist;
+} StoreRows;
+
+static void store_row(int y, const uint32_t *dist, void *arg) {
+    StoreRows *store = arg;
+    memcpy(store->dist + (size_t)y * store->width, dist, store->width * sizeof(uint32_t));
+}
+
+void Distance_squared(const BinaryImage *bin, bool target, uint32_t *dist) {
+    StoreRows store = {bin->width, dist};
+    distance_rows(bin, target, store_row, &store);
+}
+
+void Distance_image(const Image *orig, uint32_t *dist) {
+    BinaryImage bin;
+    BinaryImage_from_image(orig, &bin);
+    Distance_squared(&bin, false, dist);
+    BinaryImage_free(&bin);
+}
+
+// Largest x with x * x <= n, from the floating point root corrected by a step or two
+static int isqrt(long long n) {
+    long long x = (long long)sqrt((double)n);
+    while(x * x > n) {
+        --x;
+    }
+    while((x + 1) * (x + 1) <= n) {
+        ++x;
+    }
+    return (int)x;
+}
+
+void Distance_within(const BinaryImage *bin, bool target, int r, BinaryImage *out) {
+    BinaryImage_create(out, bin->width, bin->height);
+    // Nothing is within a negative distance, not even the target pixels
+    if(r < 0) {
+        return;
+    }
+
+    // Only the threshold matters, so the row pass does not need the envelope:
+    // a pixel at vertical distance g from a target pixel reaches half[g] pixels
+    // on both sides along the row, which is a union of intervals
+    int width = bin->width;
+    uint32_t *g = Scratch_get(SCRATCH_DISTANCE, (size_t)width * bin->height * sizeof(uint32_t));
+    int *reach = Scratch_get(SCRATCH_DISTANCE_ROW, (width + 1) * sizeof(int));
+    // Vertical distances are below the height, and no reach needs to exceed the width
+    int rows = r < bin->height ? r : bin->height;
+    int *half = Scratch_get(SCRATCH_DISTANCE_V, (rows + 1) * sizeof(int));
+    for(int dy = 0; dy <= rows; ++dy) {
+        half[dy] = isqrt((long long)r * r - (long long)dy * dy);
+        half[dy] = half[dy] < width ? half[dy] : width;
+    }
+
+    column_distances(bin, target, g);
+    for(int y = 0; y < bin->height; ++y) {
+        const uint32_t *gy = g + (size_t)y * width;
+        uint64_t *row = out->data + (size_t)y * out->words;
+
+        // reach[x]: rightmost pixel covered by an interval starting at x
+        for(int x = 0; x <= width; ++x) {
+            reach[x] = -1;
+        }
+        for(int q = 0; q < width; ++q) {
+            if(gy[q] <= (uint32_t)rows) {
+                int first = q - half[gy[q]] > 0 ? q - half[gy[q]] : 0;
+                int last = q + half[gy[q]];
+                reach[first] = last > reach[first] ? last : reach[first];
+            }
+        }
+
+        int covered = -1;
+        for(int x = 0; x < width; ++x) {
+            covered = reach[x] > covered ? reach[x] : covered;
+            row[x / 64] |= (uint64_t)(covered >= x) << (x % 64);
+        }
+    }
+}
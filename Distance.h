@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "Image.h"
+#include "BinaryImage.h"
+
+// Distance to a pixel that no image pixel has a `target` pixel to reach
+#define DISTANCE_INFINITE UINT32_MAX
+
+// Exact squared Euclidean distance transform of Felzenszwalb and Huttenlocher:
+// dist[y * width + x] is the squared distance from (x, y) to the nearest pixel of bin
+// whose value is `target`, DISTANCE_INFINITE when there is none. Linear in the number
+// of pixels: a vertical pass, then the lower envelope of parabolas along each row.
+void Distance_squared(const BinaryImage *bin, bool target, uint32_t *dist);
+
+// Squared distance from every pixel to the nearest background pixel (first channel
+// below 128), 0 on the background: the distance map of the strokes
+void Distance_image(const Image *orig, uint32_t *dist);
+
+// out gets the pixels within distance r of a `target` pixel of bin. It is created by
+// the call. With target set this is the dilation by the disc of radius r, and the
+// complement of it with target unset is the erosion: either way the cost does not depend
+// on r. Runs the vertical pass of the transform, then covers each row with the spans
+// the pixels reach at their vertical distance.
+void Distance_within(const BinaryImage *bin, bool target, int r, BinaryImage *out);
@@ -3,28 +3,96 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "Morphology.h"
 
 enum allocation_type {
-    NO_ALLOCATION, SELF_ALLOCATED, STB_ALLOCATED
+    NO_ALLOCATION, SELF_ALLOCATED, STB_ALLOCATED, POOL_ALLOCATED
 };
 
+// Consecutive rows are `stride` bytes apart, width * channels for the images created
+// or loaded here, more for views into a larger image or wrapped foreign memory, and
+// rounded up to IMAGE_ROW_ALIGNMENT with aligned rows
 typedef struct {
     int width;
     int height;
     int channels;
-    size_t size;
+    size_t size;        // bytes of pixels, width * height * channels
     uint8_t *data;
     enum allocation_type allocation_;
+    int stride;
 } Image;
 
+// Row alignment of Image_set_aligned_rows, a cache line and the widest vector
+#define IMAGE_ROW_ALIGNMENT PLANE_ROW_ALIGNMENT
+
+// Aligned rows on the calling thread: the images Image_create and Image_load give from
+// then on start each row on IMAGE_ROW_ALIGNMENT bytes, with padding at the end of the
+// rows, and so do the planes the operators work on (Plane_set_aligned_rows): luma,
+// results and tiles. Savers skip the padding. Off by default, packed rows.
+void Image_set_aligned_rows(bool aligned);
+bool Image_aligned_rows(void);
+
+// Decodes from a memory mapping of the file, through stdio when it cannot be mapped
 void Image_load(Image *img, const char *fname);
+// From the pool in use on this thread if there is one (ImagePool_use), malloc otherwise
 void Image_create(Image *img, int width, int height, int channels, bool zeroed);
 void Image_save(const Image *img, const char *fname);
 void Image_free(Image *img);
+// The width x height pixels of parent from (x, y), sharing its memory: nothing is
+// copied and Image_free leaves the view alone. Every operator takes views as input.
+void Image_view(const Image *parent, int x, int y, int width, int height, Image *view);
+// Image over memory owned by the caller, rows `stride` bytes apart
+void Image_wrap(Image *img, uint8_t *data, int width, int height, int channels, int stride);
+// Copy the pixels of src into dst, of the same size and channels: the operators create
+// their output, this is how a result lands in a view or wrapped memory
+void Image_copy(const Image *src, Image *dst);
+
+// Planar form of an image: its luma, padded for the kernels, and its alpha apart.
+// Converted once, a page then goes through any number of Morph_* operators on the
+// luma plane without going back to the interleaved pixels.
+typedef struct {
+    Plane luma;
+    Plane alpha;    // data is NULL when the image has no alpha
+} PlanarImage;
+
+// Luma as Image_get_luma, alpha from the last channel of 2 and 4 channel images
+void PlanarImage_from_image(const Image *orig, PlanarImage *planar);
+// Load and convert, the luma data is NULL when the file cannot be read
+void PlanarImage_load(PlanarImage *planar, const char *fname);
+// Interleave back: 1 channel, 2 with the alpha
+void PlanarImage_to_image(const PlanarImage *planar, Image *img);
+void PlanarImage_save(const PlanarImage *planar, const char *fname);
+void PlanarImage_free(PlanarImage *planar);
 void Image_to_gray(const Image *orig, Image *gray);
+// Plane of the average of the color channels, or of the first channel of a gray image,
+// padded for the row kernel of the small elements
+void Image_get_luma(const Image *orig, Plane *luma);
+// The same in the scratch memory of the operators, nothing allocated from one call to the
+// next: valid until the next operator call on this thread, never Plane_free it
+void Image_get_luma_scratch(const Image *orig, Plane *luma);
 void Image_to_erode(const Image *orig, Image *eroded);
 void Image_to_dilate(const Image *orig, Image *dilated);
 void Image_to_outline(const Image *orig, Image *outlined);
+void Image_to_erode_mask(const Image *orig, Image *eroded, const uint8_t *mask, int mask_width, int mask_height);
+void Image_to_dilate_mask(const Image *orig, Image *dilated, const uint8_t *mask, int mask_width, int mask_height);
+void Image_to_erode_disc(const Image *orig, Image *eroded, int r, enum disc_precision precision);
+void Image_to_dilate_disc(const Image *orig, Image *dilated, int r, enum disc_precision precision);
+void Image_to_outline_disc(const Image *orig, Image *outlined, int r, enum disc_precision precision);
+void Image_to_open_disc(const Image *orig, Image *opened, int r, enum disc_precision precision);
+void Image_to_close_disc(const Image *orig, Image *closed, int r, enum disc_precision precision);
+void Image_to_erode_rect(const Image *orig, Image *eroded, int width, int height);
+void Image_to_dilate_rect(const Image *orig, Image *dilated, int width, int height);
+void Image_to_open_rect(const Image *orig, Image *opened, int width, int height);
+void Image_to_close_rect(const Image *orig, Image *closed, int width, int height);
 void Image_to_open(const Image *orig, Image *opened);
 void Image_to_open_one(const Image *orig, Image *opened);
-void Image_to_close(const Image *orig, Image *closed);
\ No newline at end of file
+void Image_to_close(const Image *orig, Image *closed);
+void Image_tophat_threshold(const Image *orig, Image *output, int r, int t);
+void Threshold(const Image *orig, Image *transformed, Image *output, int t);
+void Image_seed_points(const Image *orig, Image *output, const Point *seeds, int count);
+void Empty_with_pixel(const Image *orig, Image *output);
+void Image_reconstruct(const Image *orig, const Image *marker, Image *output);
+void Image_reconstruct_points(const Image *orig, Image *output, const Point *seeds, int count);
+void Image_fill_holes(const Image *orig, Image *filled);
+void Image_clear_border(const Image *orig, Image *cleared);
+void Image_hmax(const Image *orig, Image *output, int h);
@@ -0,0 +1,115 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ImagePool.h"
+#include "utils.h"
+#include <pthread.h>
+
+// Smallest size class, 2^12 bytes
+#define POOL_MIN_CLASS 12
+
+// Sits in front of each buffer, padded so the buffer stays aligned on 64 bytes
+typedef struct PoolBlock {
+    ImagePool *pool;
+    struct PoolBlock *next;     // in the list of every block of the pool
+    int size_class;
+    bool in_use;
+    uint8_t padding_[64 - 2 * sizeof(void *) - sizeof(int) - sizeof(bool)];
+} PoolBlock;
+
+struct ImagePool {
+    pthread_mutex_t lock;
+    PoolBlock *blocks;
+    bool arena;
+    size_t size;
+};
+
+static __thread ImagePool *current = NULL;
+
+ImagePool *ImagePool_create(void) {
+    ImagePool *pool = calloc(1, sizeof(ImagePool));
+    ON_ERROR_EXIT(pool == NULL, "Error in creating the image pool");
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void ImagePool_destroy(ImagePool *pool) {
+    if(pool == NULL) {
+        return;
+    }
+    if(current == pool) {
+        current = NULL;
+    }
+    for(PoolBlock *block = pool->blocks, *next; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void ImagePool_use(ImagePool *pool) {
+    current = pool;
+}
+
+ImagePool *ImagePool_current(void) {
+    return current;
+}
+
+void ImagePool_set_arena(ImagePool *pool, bool arena) {
+    pthread_mutex_lock(&pool->lock);
+    pool->arena = arena;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ImagePool_reset(ImagePool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    for(PoolBlock *block = pool->blocks; block != NULL; block = block->next) {
+        block->in_use = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+uint8_t *ImagePool_get(ImagePool *pool, size_t size) {
+    int size_class = POOL_MIN_CLASS;
+    while(((size_t)1 << size_class) < size) {
+        ++size_class;
+    }
+
+    // A page holds a handful of images, the list is short
+    pthread_mutex_lock(&pool->lock);
+    PoolBlock *block = pool->blocks;
+    while(block != NULL && (block->in_use || block->size_class != size_class)) {
+        block = block->next;
+    }
+    if(block == NULL) {
+        void *memory = NULL;
+        ON_ERROR_EXIT(posix_memalign(&memory, 64, sizeof(PoolBlock) + ((size_t)1 << size_class)) != 0,
+            "Error in allocating the image buffer");
+        block = memory;
+        block->pool = pool;
+        block->size_class = size_class;
+        block->next = pool->blocks;
+        pool->blocks = block;
+        pool->size += (size_t)1 << size_class;
+    }
+    block->in_use = true;
+    pthread_mutex_unlock(&pool->lock);
+
+    return (uint8_t *)(block + 1);
+}
+
+void ImagePool_put(uint8_t *data) {
+    PoolBlock *block = (PoolBlock *)data - 1;
+    ImagePool *pool = block->pool;
+    pthread_mutex_lock(&pool->lock);
+    if(!pool->arena) {
+        block->in_use = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t ImagePool_size(ImagePool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    size_t size = pool->size;
+    pthread_mutex_unlock(&pool->lock);
+    return size;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Recycles image buffers. While a pool is in use, Image_create takes its buffers from
+// the pool and Image_free gives them back, sorted by size class (powers of two), so the
+// next image of a similar size reuses one instead of going through malloc.
+typedef struct ImagePool ImagePool;
+
+ImagePool *ImagePool_create(void);
+// Free every buffer of the pool, images still holding one must not be used anymore
+void ImagePool_destroy(ImagePool *pool);
+
+// Pool Image_create draws from on the calling thread, NULL (the default) for malloc
+void ImagePool_use(ImagePool *pool);
+ImagePool *ImagePool_current(void);
+
+// Arena mode: Image_free leaves the buffers taken and ImagePool_reset gives all of them
+// back in one call, for instance once a page is done. The images of the page must not
+// be used after the reset.
+void ImagePool_set_arena(ImagePool *pool, bool arena);
+void ImagePool_reset(ImagePool *pool);
+
+// Buffer of at least size bytes, aligned on 64 bytes, and back to its pool
+uint8_t *ImagePool_get(ImagePool *pool, size_t size);
+void ImagePool_put(uint8_t *data);
+
+// Bytes the pool holds, in use or not
+size_t ImagePool_size(ImagePool *pool);
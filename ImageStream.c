@@ -0,0 +1,443 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ImageStream.h"
+#include "Kernels.h"
+#include "Scratch.h"
+#include "utils.h"
+#include <pthread.h>
+#include <zlib.h>
+
+// Compressed bytes read from the file at a time
+#define PNG_INPUT 32768
+
+// A PNG inflated and unfiltered one scanline at a time
+struct PngReader {
+    z_stream z;
+    uint32_t chunk_left;    // bytes of the current IDAT chunk still in the file
+    int color_type;
+    int depth;
+    int samples;            // per pixel in the file: 1 for gray and palette indices, up to 4
+    int bpp;                // bytes between a byte and the same one of the previous pixel, at least 1
+    size_t line_bytes;      // bytes of a scanline, filter byte excluded
+    uint8_t *line;          // the scanline being inflated, filter byte first
+    uint8_t *prev;          // the previous one unfiltered, zeros above the first
+    uint8_t palette[256][3];
+    uint8_t input[PNG_INPUT];
+};
+
+static uint32_t png_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Length and type of the next chunk, the file being at its data on return
+static bool png_chunk(FILE *file, uint32_t *length, char type[4]) {
+    uint8_t header[8];
+    if(fread(header, 1, 8, file) != 8) {
+        return false;
+    }
+    *length = png_u32(header);
+    memcpy(type, header + 4, 4);
+    return *length <= INT32_MAX;
+}
+
+static void png_free(struct PngReader *png) {
+    if(png != NULL) {
+        inflateEnd(&png->z);
+        free(png->line);
+        free(png->prev);
+        free(png);
+    }
+}
+
+// Header and chunks of a PNG up to its first IDAT, the file being past the signature.
+// false for what does not stream: interlaced images and anything unexpected.
+static bool png_open(ImageStream *stream, FILE *file) {
+    uint32_t length;
+    char type[4];
+    uint8_t ihdr[13];
+    if(!png_chunk(file, &length, type) || memcmp(type, "IHDR", 4) || length != 13 || fread(ihdr, 1, 13, file) != 13
+        || fseek(file, 4, SEEK_CUR) != 0) {
+        return false;
+    }
+    uint32_t width = png_u32(ihdr);
+    uint32_t height = png_u32(ihdr + 4);
+    int depth = ihdr[8];
+    int color_type = ihdr[9];
+    static const int samples_of[7] = {1, 0, 3, 1, 2, 0, 4};
+    int samples = color_type <= 6 ? samples_of[color_type] : 0;
+    bool depth_ok = depth == 8 || (depth == 16 && color_type != 3) || ((color_type == 0 || color_type == 3) && (depth == 1 || depth == 2 || depth == 4));
+    if(width == 0 || height == 0 || width > (1 << 24) || height > (1 << 24) || samples == 0 || !depth_ok
+        || ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0) {
+        return false;
+    }
+
+    struct PngReader *png = calloc(1, sizeof(struct PngReader));
+    ON_ERROR_EXIT(png == NULL, "Error in creating the image stream");
+    png->color_type = color_type;
+    png->depth = depth;
+    png->samples = samples;
+    png->bpp = samples * depth >= 8 ? samples * depth / 8 : 1;
+    png->line_bytes = ((size_t)width * samples * depth + 7) / 8;
+
+    // The palette is all that matters before the pixels
+    for(;;) {
+        if(!png_chunk(file, &length, type) || !memcmp(type, "IEND", 4)) {
+            free(png);
+            return false;
+        }
+        if(!memcmp(type, "IDAT", 4)) {
+            png->chunk_left = length;
+            break;
+        }
+        if(!memcmp(type, "PLTE", 4) && length % 3 == 0 && length <= sizeof(png->palette)) {
+            if(fread(png->palette, 1, length, file) != length || fseek(file, 4, SEEK_CUR) != 0) {
+                free(png);
+                return false;
+            }
+            continue;
+        }
+        if(fseek(file, (long)length + 4, SEEK_CUR) != 0) {
+            free(png);
+            return false;
+        }
+    }
+
+    png->line = malloc(png->line_bytes + 1);
+    png->prev = calloc(png->line_bytes + 1, 1);
+    ON_ERROR_EXIT(png->line == NULL || png->prev == NULL, "Error in creating the image stream");
+    ON_ERROR_EXIT(inflateInit(&png->z) != Z_OK, "Error in creating the image stream");
+
+    // Palettes come out as RGB, like stb gives them
+    stream->width = (int)width;
+    stream->height = (int)height;
+    stream->channels = color_type == 3 ? 3 : samples;
+    stream->png_ = png;
+    return true;
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Inflate the next scanline and undo its filter, leaving it in png->prev + 1
+static void png_scanline(struct PngReader *png, FILE *file) {
+    z_stream *z = &png->z;
+    z->next_out = png->line;
+    z->avail_out = png->line_bytes + 1;
+    while(z->avail_out > 0) {
+        if(z->avail_in == 0) {
+            // The rest of the chunk, then the next IDAT one, past the CRC
+            while(png->chunk_left == 0) {
+                uint32_t length;
+                char type[4];
+                ON_ERROR_EXIT(fseek(file, 4, SEEK_CUR) != 0 || !png_chunk(file, &length, type) || memcmp(type, "IDAT", 4),
+                    "Error in reading the image");
+                png->chunk_left = length;
+            }
+            size_t n = png->chunk_left < PNG_INPUT ? png->chunk_left : PNG_INPUT;
+            ON_ERROR_EXIT(fread(png->input, 1, n, file) != n, "Error in reading the image");
+            png->chunk_left -= n;
+            z->next_in = png->input;
+            z->avail_in = n;
+        }
+        int status = inflate(z, Z_NO_FLUSH);
+        ON_ERROR_EXIT(status != Z_OK && !(status == Z_STREAM_END && z->avail_out == 0), "Error in reading the image");
+    }
+
+    uint8_t *cur = png->line + 1;
+    const uint8_t *up = png->prev + 1;
+    size_t n = png->line_bytes;
+    size_t bpp = png->bpp;
+    switch(png->line[0]) {
+    case 0:
+        break;
+    case 1:
+        for(size_t i = bpp; i < n; ++i) {
+            cur[i] += cur[i - bpp];
+        }
+        break;
+    case 2:
+        for(size_t i = 0; i < n; ++i) {
+            cur[i] += up[i];
+        }
+        break;
+    case 3:
+        for(size_t i = 0; i < n; ++i) {
+            cur[i] += ((i >= bpp ? cur[i - bpp] : 0) + up[i]) / 2;
+        }
+        break;
+    case 4:
+        for(size_t i = 0; i < n; ++i) {
+            cur[i] += i >= bpp ? paeth(cur[i - bpp], up[i], up[i - bpp]) : paeth(0, up[i], 0);
+        }
+        break;
+    default:
+        ON_ERROR_EXIT(true, "Error in reading the image");
+    }
+
+    uint8_t *done = png->line;
+    png->line = png->prev;
+    png->prev = done;
+}
+
+// The scanline in png->prev + 1 as 8 bits per channel, as stb converts it
+static void png_row(const struct PngReader *png, int width, uint8_t *out) {
+    const uint8_t *in = png->prev + 1;
+    int count = width * png->samples;
+    if(png->depth == 16) {
+        for(int i = 0; i < count; ++i) {
+            out[i] = in[2 * i];
+        }
+    } else if(png->depth == 8 && png->color_type != 3) {
+        memcpy(out, in, count);
+    } else {
+        // Gray below 8 bits is scaled to 0..255, palette indices become their color
+        int per_byte = 8 / png->depth;
+        int max = (1 << png->depth) - 1;
+        for(int x = 0; x < width; ++x) {
+            int v = in[x / per_byte] >> (8 - png->depth - x % per_byte * png->depth) & max;
+            if(png->color_type == 3) {
+                memcpy(out + 3 * x, png->palette[v], 3);
+            } else {
+                out[x] = v * (255 / max);
+            }
+        }
+    }
+}
+
+bool ImageStream_open(ImageStream *stream, const char *fname) {
+    memset(stream, 0, sizeof(ImageStream));
+    FILE *file = fopen(fname, "rb");
+    if(file == NULL) {
+        return false;
+    }
+
+    // PNG that is not interlaced, inflated scanline by scanline
+    static const uint8_t png_signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    uint8_t magic[8];
+    size_t got = fread(magic, 1, 8, file);
+    if(got == 8 && !memcmp(magic, png_signature, 8)) {
+        if(png_open(stream, file)) {
+            stream->file_ = file;
+            stream->row_ = malloc((size_t)stream->width * 4);
+            ON_ERROR_EXIT(stream->row_ == NULL, "Error in creating the image stream");
+            return true;
+        }
+        memset(stream, 0, sizeof(ImageStream));
+    }
+
+    // PGM or PPM of bytes, read row by row
+    if(got >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6') && fseek(file, 2, SEEK_SET) == 0) {
+        int width = pnm_number(file);
+        int height = width >= 0 ? pnm_number(file) : -1;
+        int maxval = height >= 0 ? pnm_number(file) : -1;
+        if(maxval <= 0 || maxval > 255) {
+            fclose(file);
+            return false;
+        }
+        stream->width = width;
+        stream->height = height;
+        stream->channels = magic[1] == '5' ? 1 : 3;
+        stream->file_ = file;
+        stream->row_ = malloc((size_t)width * stream->channels + 1);
+        ON_ERROR_EXIT(stream->row_ == NULL, "Error in creating the image stream");
+        return true;
+    }
+
+    fclose(file);
+    Image_load(&stream->decoded_, fname);
+    if(stream->decoded_.data == NULL) {
+        return false;
+    }
+    stream->width = stream->decoded_.width;
+    stream->height = stream->decoded_.height;
+    stream->channels = stream->decoded_.channels;
+    return true;
+}
+
+void ImageStream_close(ImageStream *stream) {
+    if(stream->file_ != NULL) {
+        fclose(stream->file_);
+    }
+    png_free(stream->png_);
+    free(stream->row_);
+    Image_free(&stream->decoded_);
+    memset(stream, 0, sizeof(ImageStream));
+}
+
+// Luma of the next `rows` rows, as Image_get_luma has it, into rows `stride` bytes apart
+static void stream_luma(ImageStream *stream, uint8_t *luma, int stride, int rows) {
+    size_t row_bytes = (size_t)stream->width * stream->channels;
+    for(int y = 0; y < rows; ++y, ++stream->next_row_) {
+        const uint8_t *src = stream->decoded_.data + (size_t)stream->next_row_ * stream->decoded_.stride;
+        if(stream->png_ != NULL) {
+            png_scanline(stream->png_, stream->file_);
+            png_row(stream->png_, stream->width, stream->row_);
+            src = stream->row_;
+        } else if(stream->file_ != NULL) {
+            ON_ERROR_EXIT(fread(stream->row_, 1, row_bytes, stream->file_) != row_bytes, "Error in reading the image");
+            src = stream->row_;
+        }
+
+        uint8_t *out = luma + (size_t)y * stride;
+        if(stream->channels >= 3) {
+            Kernel_gray(src, stream->channels, out, stream->width);
+        } else {
+            for(int x = 0; x < stream->width; ++x) {
+                out[x] = src[x * stream->channels];
+            }
+        }
+    }
+}
+
+// The thread that reads the rows of the next band while the current one is processed,
+// one for a whole run of bands. It takes a request at a time: `rows` rows into luma.
+typedef struct {
+    ImageStream *stream;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *luma;
+    int stride;
+    int rows;
+    bool pending;       // a request is set and not yet done
+    bool stop;
+} Reader;
+
+static void *reader_loop(void *arg) {
+    Reader *reader = arg;
+    pthread_mutex_lock(&reader->lock);
+    for(;;) {
+        while(!reader->pending && !reader->stop) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        if(!reader->pending) {
+            break;
+        }
+        pthread_mutex_unlock(&reader->lock);
+        stream_luma(reader->stream, reader->luma, reader->stride, reader->rows);
+        pthread_mutex_lock(&reader->lock);
+        reader->pending = false;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+static void reader_request(Reader *reader, uint8_t *luma, int stride, int rows) {
+    pthread_mutex_lock(&reader->lock);
+    reader->luma = luma;
+    reader->stride = stride;
+    reader->rows = rows;
+    reader->pending = true;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+static void reader_wait(Reader *reader) {
+    pthread_mutex_lock(&reader->lock);
+    while(reader->pending) {
+        pthread_cond_wait(&reader->changed, &reader->lock);
+    }
+    pthread_mutex_unlock(&reader->lock);
+}
+
+void ImageStream_bands(ImageStream *stream, int band_height, int halo_y, MorphTileFunc func, void *arg) {
+    int width = stream->width;
+    int height = stream->height;
+    int band = band_height > 0 ? band_height : 4 * halo_y;
+    band = band > 16 ? band : 16;
+    if(width == 0 || height == 0) {
+        return;
+    }
+
+    // The current band with its halos, and below it the rows of the next band as they come
+    int capacity = 2 * band + 2 * halo_y;
+    uint8_t *rows = Scratch_get(SCRATCH_STREAM, (size_t)width * capacity);
+    int first = band + halo_y < height ? band + halo_y : height;
+    stream_luma(stream, rows, width, first);
+
+    // Only a file is worth reading on the side, from a decoded image there is nothing to wait for
+    Reader reader = {.stream = stream};
+    pthread_t thread;
+    bool threaded = stream->file_ != NULL && first < height;
+    if(threaded) {
+        pthread_mutex_init(&reader.lock, NULL);
+        pthread_cond_init(&reader.changed, NULL);
+        threaded = pthread_create(&thread, NULL, reader_loop, &reader) == 0;
+        if(!threaded) {
+            pthread_mutex_destroy(&reader.lock);
+            pthread_cond_destroy(&reader.changed);
+        }
+    }
+
+    // rows holds the rows of the image from in_y up to end
+    int in_y = 0;
+    int end = first;
+    for(int y = 0; y < height; y += band) {
+        MorphTile tile;
+        tile.x = 0;
+        tile.y = y;
+        tile.width = width;
+        tile.height = height - y < band ? height - y : band;
+        tile.in_x = 0;
+        tile.in_y = in_y;
+        Plane in = {width, end - in_y, width, rows, 0, 0, 0, NULL};
+        tile.in = in;
+        Scratch_plane(SCRATCH_STREAM_WORK, &tile.work, width, end - in_y, 0);
+
+        // The next band needs up to band more rows
+        int more = height - end < band ? height - end : band;
+        uint8_t *next = rows + (size_t)(end - in_y) * width;
+        if(threaded && more > 0) {
+            reader_request(&reader, next, width, more);
+        }
+        func(&tile, arg);
+        if(threaded && more > 0) {
+            reader_wait(&reader);
+        } else if(more > 0) {
+            stream_luma(stream, next, width, more);
+        }
+        end += more;
+
+        // Drop the rows the next band no longer reaches
+        if(y + band >= height) {
+            break;
+        }
+        int next_in_y = y + band - halo_y > 0 ? y + band - halo_y : 0;
+        memmove(rows, rows + (size_t)(next_in_y - in_y) * width, (size_t)(end - next_in_y) * width);
+        in_y = next_in_y;
+    }
+
+    if(threaded) {
+        pthread_mutex_lock(&reader.lock);
+        reader.stop = true;
+        pthread_cond_broadcast(&reader.changed);
+        pthread_mutex_unlock(&reader.lock);
+        pthread_join(thread, NULL);
+        pthread_mutex_destroy(&reader.lock);
+        pthread_cond_destroy(&reader.changed);
+    }
+}
+
+typedef struct {
+    const StructElem *se;
+    enum morph_op op;
+    ImageStreamSink sink;
+    void *arg;
+} StreamSE;
+
+static void stream_se_band(const MorphTile *tile, void *arg) {
+    const StreamSE *run = arg;
+    Plane work = tile->work;
+    Morph_se(&tile->in, &work, run->se, run->op);
+    Plane result = {tile->width, tile->height, work.stride, work.data + (size_t)(tile->y - tile->in_y) * work.stride, 0, 0, 0, NULL};
+    run->sink(&result, tile->y, run->arg);
+}
+
+void ImageStream_se(ImageStream *stream, const StructElem *se, enum morph_op op, int band_height, ImageStreamSink sink, void *arg) {
+    StreamSE run = {se, op, sink, arg};
+    ImageStream_bands(stream, band_height, se->top > se->bottom ? se->top : se->bottom, stream_se_band, &run);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "Image.h"
+
+struct PngReader;
+
+// Image read a band of rows at a time. PNG files that are not interlaced stream: their
+// IDAT chunks are inflated (zlib) and unfiltered a scanline at a time, as the bands need
+// the rows, and so do binary PGM and PPM (P5, P6) files. stb has no scanline interface,
+// so JPEG, interlaced PNG and the other formats are decoded whole on open by Image_load:
+// for them the stream saves the luma and result planes, not the decode.
+typedef struct {
+    int width;
+    int height;
+    int channels;       // of the rows as decoded, 8 bits each, as Image_load gives them
+    FILE *file_;        // the PNM or PNG being read
+    struct PngReader *png_;
+    uint8_t *row_;      // one row of it, 8 bits per channel
+    Image decoded_;     // or the image stb decoded
+    int next_row_;
+} ImageStream;
+
+// false when the file cannot be read
+bool ImageStream_open(ImageStream *stream, const char *fname);
+void ImageStream_close(ImageStream *stream);
+
+// Calls func on every band of band_height rows of the luma of the image, top to bottom,
+// with halo_y rows of input on each side of it, clipped to the image, like Morph_bands.
+// Only those rows of luma are held. From a file that streams, one reader thread decodes
+// and converts the next band while func runs on the current one, and memory is
+// O(width * (band_height + halo_y)). Decoded images are converted band by band on the
+// calling thread. Bands are at least 16 rows, band_height 0 picks four halos. func may
+// run any operator on the band, Morph_tiled included.
+void ImageStream_bands(ImageStream *stream, int band_height, int halo_y, MorphTileFunc func, void *arg);
+
+// Where a streamed operator puts its result, the rows from y on, in order
+typedef void (*ImageStreamSink)(const Plane *rows, int y, void *arg);
+
+// Min/max over se of the luma of the stream, band by band. The same as Morph_se on the
+// whole luma plane, without the plane ever being whole.
+void ImageStream_se(ImageStream *stream, const StructElem *se, enum morph_op op, int band_height, ImageStreamSink sink, void *arg);
@@ -0,0 +1,420 @@
+#include "Kernels.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    void (*gray)(const uint8_t *src, int channels, uint8_t *dst, int n);
+    void (*threshold)(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t t);
+    void (*minmax)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op);
+    void (*subtract)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n);
+    void (*runs_row)(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op);
+} KernelTable;
+
+// ---------------------------------------------------------------------------
+// Scalar kernels, also used for the end of the rows the vector kernels leave
+
+static void gray_scalar(const uint8_t *src, int channels, uint8_t *dst, int n) {
+    for(int i = 0; i < n; ++i, src += channels) {
+        dst[i] = (uint8_t)((src[0] + src[1] + src[2]) / 3);
+    }
+}
+
+static void threshold_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t t) {
+    for(int i = 0; i < n; ++i) {
+        out[i] = (uint8_t)(a[i] - b[i]) >= t ? 255 : 0;
+    }
+}
+
+static void minmax_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op) {
+    if(op == MORPH_MIN) {
+        for(int i = 0; i < n; ++i) {
+            dst[i] = a[i] < b[i] ? a[i] : b[i];
+        }
+    } else {
+        for(int i = 0; i < n; ++i) {
+            dst[i] = a[i] > b[i] ? a[i] : b[i];
+        }
+    }
+}
+
+static void subtract_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n) {
+    for(int i = 0; i < n; ++i) {
+        dst[i] = (uint8_t)(a[i] - b[i]);
+    }
+}
+
+static void runs_row_tail(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int x, int width, enum morph_op op) {
+    for(; x < width; ++x) {
+        int acc = op == MORPH_MIN ? 255 : 0;
+        for(int i = 0; i < count; ++i) {
+            if(starts[i] == NULL) {
+                continue;
+            }
+            for(int l = 0; l < lengths[i]; ++l) {
+                int v = starts[i][x + l];
+                if(op == MORPH_MIN ? v < acc : v > acc) {
+                    acc = v;
+                }
+            }
+        }
+        out[x] = acc;
+    }
+}
+
+static void runs_row_scalar(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op) {
+    runs_row_tail(out, starts, lengths, count, 0, width, op);
+}
+
+static const KernelTable table_scalar = {gray_scalar, threshold_scalar, minmax_scalar, subtract_scalar, runs_row_scalar};
+
+#ifdef KERNELS_X86
+
+// ---------------------------------------------------------------------------
+// Vector kernels, written once as macros over the vector type and instructions.
+// V: vector type, W: bytes per vector, LOAD/STORE: unaligned accesses, SET1: broadcast.
+
+#define THRESHOLD_VECTOR(V, W, LOAD, STORE, SET1, SUB, MAX, CMPEQ) \
+    int i = 0; \
+    V tv = SET1((char)t); \
+    for(; i + (W) <= n; i += (W)) { \
+        V d = SUB(LOAD((const V *)(a + i)), LOAD((const V *)(b + i))); \
+        STORE((V *)(out + i), CMPEQ(MAX(d, tv), d)); \
+    } \
+    threshold_scalar(a + i, b + i, out + i, n - i, t);
+
+#define SUBTRACT_VECTOR(V, W, LOAD, STORE, SUB) \
+    int i = 0; \
+    for(; i + (W) <= n; i += (W)) { \
+        STORE((V *)(dst + i), SUB(LOAD((const V *)(a + i)), LOAD((const V *)(b + i)))); \
+    } \
+    subtract_scalar(dst + i, a + i, b + i, n - i);
+
+#define MINMAX_VECTOR(V, W, LOAD, STORE, MIN, MAX) \
+    int i = 0; \
+    if(op == MORPH_MIN) { \
+        for(; i + (W) <= n; i += (W)) { \
+            STORE((V *)(dst + i), MIN(LOAD((const V *)(a + i)), LOAD((const V *)(b + i)))); \
+        } \
+    } else { \
+        for(; i + (W) <= n; i += (W)) { \
+            STORE((V *)(dst + i), MAX(LOAD((const V *)(a + i)), LOAD((const V *)(b + i)))); \
+        } \
+    } \
+    minmax_scalar(dst + i, a + i, b + i, n - i, op);
+
+// One vector of output pixels per iteration, OP being the min or max instruction
+#define RUNS_ROW_LOOP(V, W, LOAD, STORE, SET1, OP, IDENTITY) \
+    for(; x + (W) <= width; x += (W)) { \
+        V acc = SET1((char)(IDENTITY)); \
+        for(int i = 0; i < count; ++i) { \
+            if(starts[i] == NULL) { \
+                continue; \
+            } \
+            const uint8_t *p = starts[i] + x; \
+            for(int l = 0; l < lengths[i]; ++l) { \
+                acc = OP(acc, LOAD((const V *)(p + l))); \
+            } \
+        } \
+        STORE((V *)(out + x), acc); \
+    }
+
+#define RUNS_ROW_VECTOR(V, W, LOAD, STORE, SET1, MIN, MAX) \
+    int x = 0; \
+    if(op == MORPH_MIN) { \
+        RUNS_ROW_LOOP(V, W, LOAD, STORE, SET1, MIN, 255) \
+    } else { \
+        RUNS_ROW_LOOP(V, W, LOAD, STORE, SET1, MAX, 0) \
+    } \
+    runs_row_tail(out, starts, lengths, count, x, width, op);
+
+// Sum of the three color bytes of each 32-bit pixel, divided by 3: x * 21846 >> 16
+// is exact for x <= 765. Gives 4 gray values in the low bytes of each 32-bit lane.
+#define GRAY4_SSE2(v, mask) \
+    _mm_mulhi_epu16(_mm_add_epi32(_mm_add_epi32(_mm_and_si128((v), (mask)), \
+        _mm_and_si128(_mm_srli_epi32((v), 8), (mask))), _mm_and_si128(_mm_srli_epi32((v), 16), (mask))), \
+        _mm_set1_epi32(21846))
+
+// --- SSE2 ---
+
+__attribute__((target("sse2")))
+static void gray_sse2(const uint8_t *src, int channels, uint8_t *dst, int n) {
+    int i = 0;
+    if(channels == 4) {
+        __m128i mask = _mm_set1_epi32(0xFF);
+        for(; i + 16 <= n; i += 16) {
+            const __m128i *p = (const __m128i *)(src + 4 * i);
+            __m128i g0 = GRAY4_SSE2(_mm_loadu_si128(p), mask);
+            __m128i g1 = GRAY4_SSE2(_mm_loadu_si128(p + 1), mask);
+            __m128i g2 = GRAY4_SSE2(_mm_loadu_si128(p + 2), mask);
+            __m128i g3 = GRAY4_SSE2(_mm_loadu_si128(p + 3), mask);
+            __m128i lo = _mm_packs_epi32(g0, g1);
+            __m128i hi = _mm_packs_epi32(g2, g3);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+        }
+    }
+    gray_scalar(src + (size_t)channels * i, channels, dst + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void threshold_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t t) {
+    THRESHOLD_VECTOR(__m128i, 16, _mm_loadu_si128, _mm_storeu_si128, _mm_set1_epi8, _mm_sub_epi8, _mm_max_epu8, _mm_cmpeq_epi8)
+}
+
+__attribute__((target("sse2")))
+static void minmax_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op) {
+    MINMAX_VECTOR(__m128i, 16, _mm_loadu_si128, _mm_storeu_si128, _mm_min_epu8, _mm_max_epu8)
+}
+
+__attribute__((target("sse2")))
+static void subtract_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n) {
+    SUBTRACT_VECTOR(__m128i, 16, _mm_loadu_si128, _mm_storeu_si128, _mm_sub_epi8)
+}
+
+__attribute__((target("sse2")))
+static void runs_row_sse2(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op) {
+    RUNS_ROW_VECTOR(__m128i, 16, _mm_loadu_si128, _mm_storeu_si128, _mm_set1_epi8, _mm_min_epu8, _mm_max_epu8)
+}
+
+// --- SSE4.1 (with SSSE3 byte shuffles) ---
+
+// Shuffle masks gathering channel c of 16 packed RGB pixels out of the k-th 16 bytes
+static uint8_t rgb_masks[3][3][16];
+
+static void rgb_masks_init(void) {
+    for(int c = 0; c < 3; ++c) {
+        for(int k = 0; k < 3; ++k) {
+            for(int i = 0; i < 16; ++i) {
+                int index = 3 * i + c - 16 * k;
+                rgb_masks[c][k][i] = index >= 0 && index < 16 ? index : 0x80;
+            }
+        }
+    }
+}
+
+// Gray values of the 16 RGB pixels held in v0, v1, v2 (SHUFFLE/OR/... being 128 or 256-bit forms)
+#define GRAY_RGB16(V, LOADMASK, SHUFFLE, OR, UNPACKLO, UNPACKHI, ADD, MULHI, PACKUS, SET1_16, ZERO, result) \
+    { \
+        V ch[3]; \
+        for(int c = 0; c < 3; ++c) { \
+            ch[c] = OR(OR(SHUFFLE(v0, LOADMASK(rgb_masks[c][0])), SHUFFLE(v1, LOADMASK(rgb_masks[c][1]))), \
+                SHUFFLE(v2, LOADMASK(rgb_masks[c][2]))); \
+        } \
+        V zero = ZERO(); \
+        V lo = ADD(ADD(UNPACKLO(ch[0], zero), UNPACKLO(ch[1], zero)), UNPACKLO(ch[2], zero)); \
+        V hi = ADD(ADD(UNPACKHI(ch[0], zero), UNPACKHI(ch[1], zero)), UNPACKHI(ch[2], zero)); \
+        result = PACKUS(MULHI(lo, SET1_16(21846)), MULHI(hi, SET1_16(21846))); \
+    }
+
+#define LOADMASK_128(m) _mm_loadu_si128((const __m128i *)(m))
+
+__attribute__((target("sse4.1")))
+static void gray_sse41(const uint8_t *src, int channels, uint8_t *dst, int n) {
+    if(channels != 3) {
+        gray_sse2(src, channels, dst, n);
+        return;
+    }
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        const __m128i *p = (const __m128i *)(src + 3 * i);
+        __m128i v0 = _mm_loadu_si128(p);
+        __m128i v1 = _mm_loadu_si128(p + 1);
+        __m128i v2 = _mm_loadu_si128(p + 2);
+        __m128i gray;
+        GRAY_RGB16(__m128i, LOADMASK_128, _mm_shuffle_epi8, _mm_or_si128, _mm_unpacklo_epi8, _mm_unpackhi_epi8,
+            _mm_add_epi16, _mm_mulhi_epu16, _mm_packus_epi16, _mm_set1_epi16, _mm_setzero_si128, gray)
+        _mm_storeu_si128((__m128i *)(dst + i), gray);
+    }
+    gray_scalar(src + 3 * (size_t)i, channels, dst + i, n - i);
+}
+
+// --- AVX2 ---
+
+// The same 16 bytes mask in both 128-bit lanes
+#define LOADMASK_256(m) _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(m)))
+
+__attribute__((target("avx2")))
+static void gray_avx2(const uint8_t *src, int channels, uint8_t *dst, int n) {
+    if(channels != 3) {
+        gray_sse2(src, channels, dst, n);
+        return;
+    }
+
+    // Byte shuffles stay within 128-bit lanes: the low lane takes pixels 0-15, the high lane 16-31
+    int i = 0;
+    for(; i + 32 <= n; i += 32) {
+        const uint8_t *p = src + 3 * (size_t)i;
+        __m256i v0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)), _mm_loadu_si128((const __m128i *)(p + 48)), 1);
+        __m256i v1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + 16))), _mm_loadu_si128((const __m128i *)(p + 64)), 1);
+        __m256i v2 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + 32))), _mm_loadu_si128((const __m128i *)(p + 80)), 1);
+        __m256i gray;
+        GRAY_RGB16(__m256i, LOADMASK_256, _mm256_shuffle_epi8, _mm256_or_si256, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8,
+            _mm256_add_epi16, _mm256_mulhi_epu16, _mm256_packus_epi16, _mm256_set1_epi16, _mm256_setzero_si256, gray)
+        _mm256_storeu_si256((__m256i *)(dst + i), gray);
+    }
+    gray_sse41(src + 3 * (size_t)i, channels, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void threshold_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t t) {
+    THRESHOLD_VECTOR(__m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_set1_epi8, _mm256_sub_epi8, _mm256_max_epu8, _mm256_cmpeq_epi8)
+}
+
+__attribute__((target("avx2")))
+static void minmax_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op) {
+    MINMAX_VECTOR(__m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_min_epu8, _mm256_max_epu8)
+}
+
+__attribute__((target("avx2")))
+static void subtract_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n) {
+    SUBTRACT_VECTOR(__m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_sub_epi8)
+}
+
+__attribute__((target("avx2")))
+static void runs_row_avx2(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op) {
+    RUNS_ROW_VECTOR(__m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_set1_epi8, _mm256_min_epu8, _mm256_max_epu8)
+}
+
+// --- AVX-512BW ---
+
+// Byte compares give a mask register with AVX-512, expand it back to 0/255 bytes
+#define CMPEQ_512(a, b) _mm512_movm_epi8(_mm512_cmpeq_epi8_mask((a), (b)))
+
+__attribute__((target("avx512bw")))
+static void threshold_avx512(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t t) {
+    THRESHOLD_VECTOR(__m512i, 64, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_set1_epi8, _mm512_sub_epi8, _mm512_max_epu8, CMPEQ_512)
+}
+
+__attribute__((target("avx512bw")))
+static void minmax_avx512(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op) {
+    MINMAX_VECTOR(__m512i, 64, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_min_epu8, _mm512_max_epu8)
+}
+
+__attribute__((target("avx512bw")))
+static void subtract_avx512(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n) {
+    SUBTRACT_VECTOR(__m512i, 64, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_sub_epi8)
+}
+
+__attribute__((target("avx512bw")))
+static void runs_row_avx512(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op) {
+    RUNS_ROW_VECTOR(__m512i, 64, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_set1_epi8, _mm512_min_epu8, _mm512_max_epu8)
+}
+
+static const KernelTable table_sse2 = {gray_sse2, threshold_sse2, minmax_sse2, subtract_sse2, runs_row_sse2};
+static const KernelTable table_sse41 = {gray_sse41, threshold_sse2, minmax_sse2, subtract_sse2, runs_row_sse2};
+static const KernelTable table_avx2 = {gray_avx2, threshold_avx2, minmax_avx2, subtract_avx2, runs_row_avx2};
+static const KernelTable table_avx512 = {gray_avx2, threshold_avx512, minmax_avx512, subtract_avx512, runs_row_avx512};
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Dispatch
+
+static const KernelTable *kernels = &table_scalar;
+static enum simd_level current_level = SIMD_SCALAR;
+
+static const char *level_names[] = {"scalar", "sse2", "sse4.1", "avx2", "avx512bw"};
+
+enum simd_level Kernels_detect(void) {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512bw")) {
+        return SIMD_AVX512BW;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if(__builtin_cpu_supports("sse4.1")) {
+        return SIMD_SSE41;
+    }
+    if(__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+enum simd_level Kernels_level(void) {
+    return current_level;
+}
+
+const char *Kernels_level_name(enum simd_level level) {
+    return level_names[level];
+}
+
+enum simd_level Kernels_set_level(enum simd_level wanted) {
+    enum simd_level supported = Kernels_detect();
+    current_level = wanted < supported ? wanted : supported;
+
+    kernels = &table_scalar;
+#ifdef KERNELS_X86
+    switch(current_level) {
+    case SIMD_AVX512BW:
+        kernels = &table_avx512;
+        break;
+    case SIMD_AVX2:
+        kernels = &table_avx2;
+        break;
+    case SIMD_SSE41:
+        kernels = &table_sse41;
+        break;
+    case SIMD_SSE2:
+        kernels = &table_sse2;
+        break;
+    case SIMD_SCALAR:
+        break;
+    }
+#endif
+    return current_level;
+}
+
+__attribute__((constructor))
+static void Kernels_init(void) {
+#ifdef KERNELS_X86
+    rgb_masks_init();
+#endif
+    enum simd_level wanted = SIMD_AVX512BW;
+    const char *env = getenv("OCR_SIMD");
+    if(env != NULL) {
+        for(int l = SIMD_SCALAR; l <= SIMD_AVX512BW; ++l) {
+            if(!strcmp(env, level_names[l])) {
+                wanted = l;
+            }
+        }
+    }
+    Kernels_set_level(wanted);
+}
+
+// ---------------------------------------------------------------------------
+// Entry points
+
+void Kernel_gray(const uint8_t *src, int channels, uint8_t *dst, int n) {
+    kernels->gray(src, channels, dst, n);
+}
+
+void Kernel_threshold(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, int t) {
+    // Every difference passes (or fails) a threshold out of the byte range
+    if(t <= 0 || t > 255) {
+        memset(out, t <= 0 ? 255 : 0, n);
+        return;
+    }
+    kernels->threshold(a, b, out, n, (uint8_t)t);
+}
+
+void Kernel_minmax(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op) {
+    kernels->minmax(dst, a, b, n, op);
+}
+
+void Kernel_subtract(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n) {
+    kernels->subtract(dst, a, b, n);
+}
+
+void Kernel_runs_row(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op) {
+    kernels->runs_row(out, starts, lengths, count, width, op);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include "Morphology.h"
+
+// Row kernels behind the Image and Morph_* operators. Every kernel exists for
+// several instruction sets, the best one the CPU supports is bound at startup.
+// All levels give bit-identical results.
+
+enum simd_level {
+    SIMD_SCALAR, SIMD_SSE2, SIMD_SSE41, SIMD_AVX2, SIMD_AVX512BW
+};
+
+// Best level the CPU supports
+enum simd_level Kernels_detect(void);
+// Level in use. At startup it is the detected one, unless OCR_SIMD is set in the
+// environment to one of scalar, sse2, sse4.1, avx2 or avx512bw.
+enum simd_level Kernels_level(void);
+// Bind the kernels of `level`, lowered to what the CPU supports. Returns the level now in use.
+enum simd_level Kernels_set_level(enum simd_level level);
+const char *Kernels_level_name(enum simd_level level);
+
+// dst[i] = (r + g + b) / 3 of the i-th pixel of src, which has 3 or 4 channels
+void Kernel_gray(const uint8_t *src, int channels, uint8_t *dst, int n);
+
+// out[i] = (uint8_t)(a[i] - b[i]) >= t ? 255 : 0
+void Kernel_threshold(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, int t);
+
+// dst[i] = min/max(a[i], b[i]). dst may be a or b, or a with b further ahead in the same
+// buffer: the kernel reads each element before it writes over it.
+void Kernel_minmax(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, enum morph_op op);
+
+// dst[i] = (uint8_t)(a[i] - b[i]), dst may be a or b
+void Kernel_subtract(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n);
+
+// out[x] = min/max over i of starts[i][x .. x + lengths[i] - 1], for x in [0, width):
+// the runs of a structuring element over the rows they fall on. NULL starts are skipped.
+void Kernel_runs_row(uint8_t *out, const uint8_t *const *starts, const int *lengths, int count, int width, enum morph_op op);
@@ -0,0 +1,1049 @@
+#define _POSIX_C_SOURCE 200809L
+#include "Morphology.h"
+#include "Kernels.h"
+#include "ThreadPool.h"
+#include "Scratch.h"
+#include "utils.h"
+#include <stddef.h>
+
+// Rows of the planes created on this thread start on PLANE_ROW_ALIGNMENT bytes when set
+static __thread bool aligned_rows = false;
+
+void Plane_set_aligned_rows(bool aligned) {
+    aligned_rows = aligned;
+}
+
+bool Plane_aligned_rows(void) {
+    return aligned_rows;
+}
+
+static int round_up(int n) {
+    return (n + PLANE_ROW_ALIGNMENT - 1) / PLANE_ROW_ALIGNMENT * PLANE_ROW_ALIGNMENT;
+}
+
+// The left border and the stride: packed rows, or the first pixel of every row
+// on the alignment with the border before it and padding after the right border
+static void plane_layout(int width, int border, int *lead, int *stride) {
+    *lead = aligned_rows ? round_up(border) : border;
+    *stride = aligned_rows ? round_up(*lead + width + border) : width + 2 * border;
+}
+
+size_t Plane_size(int width, int height, int border) {
+    int lead, stride;
+    plane_layout(width, border, &lead, &stride);
+    return (size_t)stride * (height + 2 * border);
+}
+
+void Plane_place(Plane *plane, uint8_t *memory, int width, int height, int border) {
+    int lead, stride;
+    plane_layout(width, border, &lead, &stride);
+    plane->data = memory + (size_t)border * stride + lead;
+    plane->width = width;
+    plane->height = height;
+    plane->stride = stride;
+    plane->border = border;
+    plane->filled = 0;
+    plane->fill_value = 0;
+    plane->allocation_ = NULL;
+}
+
+void Plane_create(Plane *plane, int width, int height) {
+    Plane_create_padded(plane, width, height, 0);
+}
+
+void Plane_create_padded(Plane *plane, int width, int height, int border) {
+    size_t size = Plane_size(width, height, border);
+    void *memory = NULL;
+    if(aligned_rows) {
+        memory = posix_memalign(&memory, PLANE_ROW_ALIGNMENT, size) == 0 ? memory : NULL;
+    } else {
+        memory = malloc(size);
+    }
+    ON_ERROR_EXIT(memory == NULL && size != 0, "Error in creating the plane");
+    Plane_place(plane, memory, width, height, border);
+    plane->allocation_ = memory;
+}
+
+void Plane_free(Plane *plane) {
+    free(plane->allocation_);
+    plane->allocation_ = NULL;
+    plane->data = NULL;
+    plane->width = 0;
+    plane->height = 0;
+    plane->stride = 0;
+    plane->border = 0;
+    plane->filled = 0;
+}
+
+static int border_index(int i, int n, enum border_mode mode) {
+    if(mode == BORDER_REPLICATE || n == 1) {
+        return i < 0 ? 0 : n - 1;
+    }
+    int period = 2 * (n - 1);
+    i = (i % period + period) % period;
+    return i < n ? i : period - i;
+}
+
+void Plane_fill_border(Plane *plane, int radius, enum border_mode mode, uint8_t value) {
+    int width = plane->width;
+    int height = plane->height;
+    int stride = plane->stride;
+    radius = radius < plane->border ? radius : plane->border;
+    if(radius <= 0 || width == 0 || height == 0) {
+        return;
+    }
+    if(mode == BORDER_CONSTANT && plane->filled >= radius && plane->fill_value == value) {
+        return;
+    }
+
+    // Both ends of every row, then the rows above and below, corners included
+    for(int y = 0; y < height; ++y) {
+        uint8_t *row = plane->data + (size_t)y * stride;
+        if(mode == BORDER_CONSTANT) {
+            memset(row - radius, value, radius);
+            memset(row + width, value, radius);
+            continue;
+        }
+        for(int i = 1; i <= radius; ++i) {
+            row[-i] = row[border_index(-i, width, mode)];
+            row[width - 1 + i] = row[border_index(width - 1 + i, width, mode)];
+        }
+    }
+    for(int i = 1; i <= radius; ++i) {
+        uint8_t *above = plane->data - (ptrdiff_t)i * stride - radius;
+        uint8_t *below = plane->data + (ptrdiff_t)(height - 1 + i) * stride - radius;
+        if(mode == BORDER_CONSTANT) {
+            memset(above, value, width + 2 * radius);
+            memset(below, value, width + 2 * radius);
+        } else {
+            memcpy(above, plane->data + (ptrdiff_t)border_index(-i, height, mode) * stride - radius, width + 2 * radius);
+            memcpy(below, plane->data + (ptrdiff_t)border_index(height - 1 + i, height, mode) * stride - radius, width + 2 * radius);
+        }
+    }
+
+    plane->filled = mode == BORDER_CONSTANT ? radius : 0;
+    plane->fill_value = value;
+}
+
+void Plane_copy(const Plane *src, Plane *dst) {
+    if(src->data == dst->data) {
+        return;
+    }
+    for(int y = 0; y < src->height; ++y) {
+        memcpy(dst->data + (size_t)y * dst->stride, src->data + (size_t)y * src->stride, src->width);
+    }
+}
+
+// The part of a plane starting at (x, y), which may be in the border
+static Plane Plane_view(const Plane *plane, int x, int y, int width, int height) {
+    Plane view = {width, height, plane->stride, plane->data + (ptrdiff_t)y * plane->stride + x, 0, 0, 0, NULL};
+    return view;
+}
+
+static int tile_size = MORPH_TILE_SIZE;
+
+int Morph_tile_size(void) {
+    return tile_size;
+}
+
+void Morph_set_tile_size(int size) {
+    tile_size = size > 64 ? size : 64;
+}
+
+// Tiles of tile_width x tile_height, spread over the thread pool
+typedef struct {
+    const Plane *src;
+    int tile_width;
+    int tile_height;
+    int tiles_x;
+    int halo_x;
+    int halo_y;
+    MorphTileFunc func;
+    void *arg;
+    bool aligned;       // the row alignment of the thread that started the run
+} TileRun;
+
+static void run_tile(int task, int worker, void *arg) {
+    const TileRun *run = arg;
+    const Plane *src = run->src;
+    MorphTile t;
+    t.x = task % run->tiles_x * run->tile_width;
+    t.y = task / run->tiles_x * run->tile_height;
+    t.width = src->width - t.x < run->tile_width ? src->width - t.x : run->tile_width;
+    t.height = src->height - t.y < run->tile_height ? src->height - t.y : run->tile_height;
+    t.in_x = t.x - run->halo_x > 0 ? t.x - run->halo_x : 0;
+    t.in_y = t.y - run->halo_y > 0 ? t.y - run->halo_y : 0;
+    int x1 = t.x + t.width + run->halo_x < src->width ? t.x + t.width + run->halo_x : src->width;
+    int y1 = t.y + t.height + run->halo_y < src->height ? t.y + t.height + run->halo_y : src->height;
+    t.in = Plane_view(src, t.in_x, t.in_y, x1 - t.in_x, y1 - t.in_y);
+
+    // The work plane is laid out as the caller's planes are, whichever thread runs the tile
+    (void)worker;
+    aligned_rows = run->aligned;
+    Scratch_plane(SCRATCH_TILE, &t.work, x1 - t.in_x, y1 - t.in_y, 0);
+    run->func(&t, run->arg);
+}
+
+static void Morph_run_tiles(const Plane *src, int tile_width, int tile_height, int halo_x, int halo_y, MorphTileFunc func, void *arg) {
+    if(src->width == 0 || src->height == 0) {
+        return;
+    }
+    int tiles_x = (src->width + tile_width - 1) / tile_width;
+    int tiles_y = (src->height + tile_height - 1) / tile_height;
+    TileRun run = {src, tile_width, tile_height, tiles_x, halo_x, halo_y, func, arg, aligned_rows};
+    ThreadPool_for(tiles_x * tiles_y, run_tile, &run);
+}
+
+void Morph_tiled(const Plane *src, int halo_x, int halo_y, MorphTileFunc func, void *arg) {
+    int halo = halo_x > halo_y ? halo_x : halo_y;
+
+    // Keep the halo small compared to the tile, and the tiles on whole words of a bit mask
+    int tile = tile_size > 4 * halo ? tile_size : 4 * halo;
+    tile = (tile + 63) / 64 * 64;
+    Morph_run_tiles(src, tile, tile, halo_x, halo_y, func, arg);
+}
+
+void Morph_bands(const Plane *src, int halo_y, MorphTileFunc func, void *arg) {
+    // Two bands per thread to even out the load, each well above its halo
+    int threads = ThreadPool_size();
+    int band = (src->height + 2 * threads - 1) / (2 * threads);
+    band = band > 4 * halo_y ? band : 4 * halo_y;
+    band = band > 16 ? band : 16;
+    Morph_run_tiles(src, src->width, band, 0, halo_y, func, arg);
+}
+
+// van Herk/Gil-Werman pass over buf[0..m), m being a multiple of w = 2k+1.
+// On return buf[j] holds the min/max of the window starting at j.
+static void vhgw(uint8_t *buf, uint8_t *g, uint8_t *h, int m, int k, enum morph_op op) {
+    int w = 2 * k + 1;
+
+    // g: running extremum from the start of each block, h: from its end
+    for(int i = 0; i < m; i += w) {
+        g[i] = buf[i];
+        h[i + w - 1] = buf[i + w - 1];
+        if(op == MORPH_MIN) {
+            for(int l = 1; l < w; ++l) {
+                g[i + l] = g[i + l - 1] < buf[i + l] ? g[i + l - 1] : buf[i + l];
+                h[i + w - 1 - l] = h[i + w - l] < buf[i + w - 1 - l] ? h[i + w - l] : buf[i + w - 1 - l];
+            }
+        } else {
+            for(int l = 1; l < w; ++l) {
+                g[i + l] = g[i + l - 1] > buf[i + l] ? g[i + l - 1] : buf[i + l];
+                h[i + w - 1 - l] = h[i + w - l] > buf[i + w - 1 - l] ? h[i + w - l] : buf[i + w - 1 - l];
+            }
+        }
+    }
+
+    // A window of w samples spans at most two blocks
+    if(op == MORPH_MIN) {
+        for(int j = 0; j + 2 * k < m; ++j) {
+            buf[j] = h[j] < g[j + 2 * k] ? h[j] : g[j + 2 * k];
+        }
+    } else {
+        for(int j = 0; j + 2 * k < m; ++j) {
+            buf[j] = h[j] > g[j + 2 * k] ? h[j] : g[j + 2 * k];
+        }
+    }
+}
+
+// Filter the n samples stored at buf[k..k+n) and leave the result in buf[0..n).
+// buf holds three arrays of `capacity` bytes, the last two are scratch space.
+static void vhgw_line(uint8_t *buf, int capacity, int n, int k, enum morph_op op) {
+    int w = 2 * k + 1;
+    int len = (n + 2 * k + w - 1) / w * w;
+    uint8_t identity = op == MORPH_MIN ? 255 : 0;
+
+    memset(buf, identity, k);
+    memset(buf + k + n, identity, len - k - n);
+    vhgw(buf, buf + capacity, buf + 2 * capacity, len, k, op);
+}
+
+// Size of each array of a vhgw_line buffer for lines of up to n samples and half-lengths up to k
+static int vhgw_capacity(int n, int k) {
+    return n + 4 * k + 1;
+}
+
+// Min/max over (x - left .. x + right, y) into dst: extrema over spans of doubling
+// length, log2 of the width passes of the vector kernel, each reading ahead of what it writes
+static void Morph_rows(const Plane *src, Plane *dst, int left, int right, enum morph_op op) {
+    int width = src->width;
+    uint8_t identity = op == MORPH_MIN ? 255 : 0;
+    int w = left + right + 1;
+    uint8_t *buf = Scratch_get(SCRATCH_ROW, (size_t)width + w - 1);
+    for(int y = 0; y < src->height; ++y) {
+        uint8_t *out = dst->data + (size_t)y * dst->stride;
+        if(w == 1) {
+            memmove(out, src->data + (size_t)y * src->stride, width);
+            continue;
+        }
+        memset(buf, identity, left);
+        memcpy(buf + left, src->data + (size_t)y * src->stride, width);
+        memset(buf + left + width, identity, right);
+
+        int valid = width + w - 1;
+        int length = 1;
+        for(; 2 * length <= w; length *= 2) {
+            valid -= length;
+            Kernel_minmax(buf, buf, buf + length, valid, op);
+        }
+        Kernel_minmax(out, buf, buf + w - length, width, op);
+    }
+}
+
+// out[x] = min/max(row[x], other[x + shift]), row[x] where x + shift is outside [0, n)
+static void shifted_minmax(uint8_t *out, const uint8_t *row, const uint8_t *other, int n, int shift, enum morph_op op) {
+    if(shift >= 0) {
+        Kernel_minmax(out, row, other + shift, n - shift, op);
+        memcpy(out + n - shift, row + n - shift, shift);
+    } else {
+        memcpy(out, row, -shift);
+        Kernel_minmax(out - shift, row - shift, other, n + shift, op);
+    }
+}
+
+// Row y of src between reach_x identity pixels on each side, in `in` whose sides are
+// already filled, or `outside`, all identity, for a row outside the image
+static const uint8_t *extended_row(const Plane *src, int y, uint8_t *in, const uint8_t *outside, int reach_x) {
+    if(y < 0 || y >= src->height) {
+        return outside;
+    }
+    memcpy(in + reach_x, src->data + (size_t)y * src->stride, src->width);
+    return in;
+}
+
+// Lines going down (dy > 0), a whole row at a time on the vector kernel. The plane is
+// extended by the reach of the line on each side, pixels outside the image being the
+// identity. Along each line the samples fall in blocks of w = 2k+1, by row: g holds the
+// running extremum from the start of the block, h from its end, each row of them from
+// the row dy above or below shifted by dx. A window of w samples spans at most two
+// blocks, so the output is the extremum of h at its first sample and g at its last one.
+static void Morph_line_rows(const Plane *src, Plane *dst, int dx, int dy, int k, enum morph_op op) {
+    int width = src->width;
+    int height = src->height;
+    int w = 2 * k + 1;
+    int reach_y = k * dy;
+    int reach_x = k * (dx >= 0 ? dx : -dx);
+    int ext_width = width + 2 * reach_x;
+    int ext_height = height + 2 * reach_y;
+    uint8_t identity = op == MORPH_MIN ? 255 : 0;
+
+    uint8_t *g = Scratch_get(SCRATCH_COLUMN_G, (size_t)ext_height * ext_width);
+    uint8_t *h = Scratch_get(SCRATCH_COLUMN_H, (size_t)ext_height * ext_width);
+    uint8_t *in = Scratch_get(SCRATCH_ROW, 2 * (size_t)ext_width);
+    uint8_t *outside = in + ext_width;
+    memset(in, identity, reach_x);
+    memset(in + reach_x + width, identity, reach_x);
+    memset(outside, identity, ext_width);
+
+    for(int j = 0; j < ext_height; ++j) {
+        const uint8_t *row = extended_row(src, j - reach_y, in, outside, reach_x);
+        uint8_t *out = g + (size_t)j * ext_width;
+        if(j % (w * dy) < dy) {
+            memcpy(out, row, ext_width);
+        } else {
+            shifted_minmax(out, row, out - (size_t)dy * ext_width, ext_width, -dx, op);
+        }
+    }
+    for(int j = ext_height - 1; j >= 0; --j) {
+        const uint8_t *row = extended_row(src, j - reach_y, in, outside, reach_x);
+        uint8_t *out = h + (size_t)j * ext_width;
+        if(j % (w * dy) >= (w - 1) * dy || j + dy >= ext_height) {
+            memcpy(out, row, ext_width);
+        } else {
+            shifted_minmax(out, row, out + (size_t)dy * ext_width, ext_width, dx, op);
+        }
+    }
+
+    // The window of (x, y) runs from (x - k*dx, y - k*dy) to (x + k*dx, y + k*dy)
+    for(int y = 0; y < height; ++y) {
+        Kernel_minmax(dst->data + (size_t)y * dst->stride,
+            h + (size_t)y * ext_width + reach_x - k * dx,
+            g + (size_t)(y + 2 * reach_y) * ext_width + reach_x + k * dx, width, op);
+    }
+}
+
+void Morph_line(const Plane *src, Plane *dst, int dx, int dy, int k, enum morph_op op) {
+    int width = src->width;
+    int height = src->height;
+
+    if(k <= 0 || (dx == 0 && dy == 0)) {
+        Plane_copy(src, dst);
+        return;
+    }
+
+    // The element is symmetric, walk every line downwards (or rightwards)
+    if(dy < 0 || (dy == 0 && dx < 0)) {
+        dx = -dx;
+        dy = -dy;
+    }
+    if(dy > 0) {
+        Morph_line_rows(src, dst, dx, dy, k, op);
+        return;
+    }
+    if(dx == 1) {
+        Morph_rows(src, dst, k, k, op);
+        return;
+    }
+
+    // Periodic horizontal lines, one gathered line at a time
+    int capacity = vhgw_capacity(width, k);
+    uint8_t *buf = Scratch_get(SCRATCH_LINE, 3 * (size_t)capacity);
+    for(int y = 0; y < height; ++y) {
+        uint8_t *row = dst->data + (size_t)y * dst->stride;
+        const uint8_t *in = src->data + (size_t)y * src->stride;
+        for(int x0 = 0; x0 < dx && x0 < width; ++x0) {
+            int n = 0;
+            for(int x = x0; x < width; x += dx) {
+                buf[k + n++] = in[x];
+            }
+            vhgw_line(buf, capacity, n, k, op);
+            n = 0;
+            for(int x = x0; x < width; x += dx) {
+                row[x] = buf[n++];
+            }
+        }
+    }
+}
+
+// Rectangles: a pass along the rows, then a van Herk/Gil-Werman pass down the columns
+// that handles whole rows at a time. Both run on the vector min/max kernel.
+static void Morph_rect(const Plane *src, Plane *dst, const StructElem *se, enum morph_op op) {
+    int width = src->width;
+    int height = src->height;
+    uint8_t identity = op == MORPH_MIN ? 255 : 0;
+
+    Morph_rows(src, dst, se->left, se->right, op);
+
+    int w = se->top + se->bottom + 1;
+    if(w == 1 || height == 0) {
+        return;
+    }
+
+    // Row j of the padded column sequence is image row j - top, identity outside the image.
+    // g and h hold the running extrema from the start and from the end of each block of w rows.
+    int m = (height + w - 1 + w - 1) / w * w;
+    uint8_t *g = Scratch_get(SCRATCH_COLUMN_G, (size_t)m * width);
+    uint8_t *h = Scratch_get(SCRATCH_COLUMN_H, (size_t)m * width);
+#define ROW(j) ((j) - se->top >= 0 && (j) - se->top < height ? dst->data + (size_t)((j) - se->top) * dst->stride : NULL)
+    for(int i = 0; i < m; i += w) {
+        for(int l = 0; l < w; ++l) {
+            const uint8_t *in = ROW(i + l);
+            uint8_t *out = g + (size_t)(i + l) * width;
+            if(in == NULL) {
+                if(l == 0) {
+                    memset(out, identity, width);
+                } else {
+                    memcpy(out, out - width, width);
+                }
+            } else {
+                if(l == 0) {
+                    memcpy(out, in, width);
+                } else {
+                    Kernel_minmax(out, out - width, in, width, op);
+                }
+            }
+        }
+        for(int l = w - 1; l >= 0; --l) {
+            const uint8_t *in = ROW(i + l);
+            uint8_t *out = h + (size_t)(i + l) * width;
+            if(in == NULL) {
+                if(l == w - 1) {
+                    memset(out, identity, width);
+                } else {
+                    memcpy(out, out + width, width);
+                }
+            } else {
+                if(l == w - 1) {
+                    memcpy(out, in, width);
+                } else {
+                    Kernel_minmax(out, out + width, in, width, op);
+                }
+            }
+        }
+    }
+#undef ROW
+
+    // Output row y is the window of padded rows y .. y + w - 1
+    for(int y = 0; y < height; ++y) {
+        Kernel_minmax(dst->data + (size_t)y * dst->stride, h + (size_t)y * width, g + (size_t)(y + w - 1) * width, width, op);
+    }
+
+}
+
+// Elements within 5x5: every input row is copied once between identity borders,
+// then the vector kernel combines the runs over whole rows
+static void Morph_small(const Plane *src, Plane *dst, const StructElem *se, enum morph_op op) {
+    int width = src->width;
+    int height = src->height;
+    int span = se->top + se->bottom + 1;
+    int pad = se->left > se->right ? se->left : se->right;
+    int padded = width + 2 * pad;
+    uint8_t identity = op == MORPH_MIN ? 255 : 0;
+    const uint8_t *starts[15];
+    int lengths[15];
+    for(int i = 0; i < se->run_count; ++i) {
+        lengths[i] = se->runs[i].length;
+    }
+
+    // With a border already filled with the identity as far as the element reaches, the
+    // runs read the plane itself: no row copies and no rows outside the image to skip.
+    // src is const, filling its border is left to the caller.
+    int reach = pad > se->top ? pad : se->top;
+    reach = reach > se->bottom ? reach : se->bottom;
+    if(src->filled >= reach && src->fill_value == identity && src->data != dst->data) {
+        for(int y = 0; y < height; ++y) {
+            for(int i = 0; i < se->run_count; ++i) {
+                starts[i] = src->data + (ptrdiff_t)(y + se->runs[i].dy) * src->stride + se->runs[i].dx;
+            }
+            Kernel_runs_row(dst->data + (size_t)y * dst->stride, starts, lengths, se->run_count, width, op);
+        }
+        return;
+    }
+
+    uint8_t *ring = Scratch_get(SCRATCH_RING, (size_t)span * padded);
+    int ring_row[5] = {-1, -1, -1, -1, -1};
+
+    for(int y = 0; y < height; ++y) {
+        // All the rows under the element are copied before row y is written, so src may be dst
+        for(int row = y - se->top; row <= y + se->bottom; ++row) {
+            if(row < 0 || row >= height || ring_row[row % span] == row) {
+                continue;
+            }
+            uint8_t *slot = ring + (size_t)(row % span) * padded;
+            ring_row[row % span] = row;
+            memset(slot, identity, pad);
+            memcpy(slot + pad, src->data + (size_t)row * src->stride, width);
+            memset(slot + pad + width, identity, pad);
+        }
+
+        for(int i = 0; i < se->run_count; ++i) {
+            int row = y + se->runs[i].dy;
+            starts[i] = row < 0 || row >= height ? NULL : ring + (size_t)(row % span) * padded + pad + se->runs[i].dx;
+        }
+
+        Kernel_runs_row(dst->data + (size_t)y * dst->stride, starts, lengths, se->run_count, width, op);
+    }
+}
+
+// Chord tables of the rows under the element, for the min, the max or both: ops is a
+// mask of (1 << MORPH_MIN) and (1 << MORPH_MAX), and with both dst gets max - min.
+// Both extrema come from one set of max tables: each table holds the row, then its
+// complement, whose max is the complement of the min. Every step of the tables and
+// every run of the output is then one kernel call over both halves.
+static void Morph_chords(const Plane *src, Plane *dst, const StructElem *se, int ops) {
+    int width = src->width;
+    int height = src->height;
+    bool gradient = ops == ((1 << MORPH_MIN) | (1 << MORPH_MAX));
+    enum morph_op op = gradient || ops == (1 << MORPH_MAX) ? MORPH_MAX : MORPH_MIN;
+    uint8_t identity = op == MORPH_MIN ? 255 : 0;
+
+    // Tables of the rows under the element, in a ring indexed by image row. With the
+    // gradient, the complement half starts `padded` bytes into each table.
+    int span = se->top + se->bottom + 1;
+    int padded = width + se->left + se->right;
+    int table_size = gradient ? 2 * padded : padded;
+    size_t slot_size = (size_t)se->length_count * table_size;
+    uint8_t *ring = Scratch_get(SCRATCH_RING, span * slot_size);
+    int *ring_row = Scratch_get(SCRATCH_RING_ROWS, span * sizeof(int));
+    for(int s = 0; s < span; ++s) {
+        ring_row[s] = -1;
+    }
+
+    // The gradient forms its two extrema `padded` apart in a row of its own,
+    // and complements through a row of 255
+    uint8_t *both = NULL;
+    uint8_t *full = NULL;
+    if(gradient) {
+        both = Scratch_get(SCRATCH_SECOND_ROW, (size_t)padded + 2 * width);
+        full = both + padded + width;
+        memset(full, 255, width);
+    }
+
+    for(int y = 0; y < height; ++y) {
+        // Rows under the whole element, which includes row y, are loaded
+        // before the output row is written, so src may be dst
+        for(int row = y - se->top; row <= y + se->bottom; ++row) {
+            int s = row % span;
+            if(row < 0 || row >= height || ring_row[s] == row) {
+                continue;
+            }
+            ring_row[s] = row;
+
+            // Outside the image the identity of the max is also the complement of that of the min
+            uint8_t *table = ring + s * slot_size;
+            const uint8_t *in = src->data + (size_t)row * src->stride;
+            memset(table, identity, se->left);
+            memcpy(table + se->left, in, width);
+            memset(table + se->left + width, identity, se->right);
+            if(gradient) {
+                memset(table + padded, 0, se->left);
+                Kernel_subtract(table + padded + se->left, full, in, width);
+                memset(table + padded + se->left + width, 0, se->right);
+            }
+
+            // Across the halves the steps mix the end of the row with the start of the
+            // complement, past what the longer runs ever read
+            for(int t = 1; t < se->length_count; ++t) {
+                const uint8_t *prev = table + (size_t)(t - 1) * table_size;
+                Kernel_minmax(table + (size_t)t * table_size, prev, prev + se->lengths[t] - se->lengths[t - 1], table_size - se->lengths[t] + 1, op);
+            }
+        }
+
+        uint8_t *out = dst->data + (size_t)y * dst->stride;
+        uint8_t *row_out = gradient ? both : out;
+        int n = gradient ? padded + width : width;
+        memset(row_out, identity, n);
+        for(int i = 0; i < se->run_count; ++i) {
+            const SERun *run = &se->runs[i];
+            int row = y + run->dy;
+            if(row < 0 || row >= height) {
+                continue;
+            }
+            const uint8_t *table = ring + (row % span) * slot_size + (size_t)run->table * table_size;
+            Kernel_minmax(row_out, row_out, table + se->left + run->dx, n, op);
+        }
+        if(gradient) {
+            // max - min, the min being the complement of the max of the complement
+            Kernel_subtract(both + padded, full, both + padded, width);
+            Kernel_subtract(out, both, both + padded, width);
+        }
+    }
+
+}
+
+// Dilations take the lines in the reverse order of erosions: with the border
+// clipped, that is what keeps an opening below and a closing above its input
+static void Morph_lines(const Plane *src, Plane *dst, const StructElem *se, enum morph_op op) {
+    for(int i = 0; i < se->line_count; ++i) {
+        const LineSE *line = &se->lines[op == MORPH_MIN ? i : se->line_count - 1 - i];
+        Morph_line(i == 0 ? src : dst, dst, line->dx, line->dy, line->k, op);
+    }
+}
+
+// Any element over the whole plane at once, src and dst may be the same plane
+static void Morph_untiled(const Plane *src, Plane *dst, const StructElem *se, enum morph_op op) {
+    if(se->rect) {
+        Morph_rect(src, dst, se, op);
+    } else if(se->line_count > 0) {
+        Morph_lines(src, dst, se, op);
+    } else if(se->left <= 2 && se->right <= 2 && se->top <= 2 && se->bottom <= 2) {
+        Morph_small(src, dst, se, op);
+    } else {
+        Morph_chords(src, dst, se, 1 << op);
+    }
+}
+
+typedef struct {
+    const StructElem *se;
+    enum morph_op op;
+    Plane *dst;
+} LinesTile;
+
+static void lines_tile(const MorphTile *tile, void *arg) {
+    const LinesTile *lines = arg;
+    Plane work = tile->work;
+    Morph_untiled(&tile->in, &work, lines->se, lines->op);
+    Plane result = Plane_view(&work, tile->x - tile->in_x, tile->y - tile->in_y, tile->width, tile->height);
+    Plane out = Plane_view(lines->dst, tile->x, tile->y, tile->width, tile->height);
+    Plane_copy(&result, &out);
+}
+
+
+typedef struct {
+    const StructElem *se;
+    int ops;            // mask of (1 << MORPH_MIN) and (1 << MORPH_MAX), both for the gradient
+    Plane *dst;
+} BandRun;
+
+static void band_tile(const MorphTile *tile, void *arg) {
+    const BandRun *band = arg;
+    Plane work = tile->work;
+    if(band->ops == (1 << MORPH_MIN) || band->ops == (1 << MORPH_MAX)) {
+        Morph_untiled(&tile->in, &work, band->se, band->ops == (1 << MORPH_MIN) ? MORPH_MIN : MORPH_MAX);
+    } else {
+        Morph_chords(&tile->in, &work, band->se, band->ops);
+    }
+    Plane result = Plane_view(&work, 0, tile->y - tile->in_y, tile->width, tile->height);
+    Plane out = Plane_view(band->dst, tile->x, tile->y, tile->width, tile->height);
+    Plane_copy(&result, &out);
+}
+
+void Morph_se(const Plane *src, Plane *dst, const StructElem *se, enum morph_op op) {
+    // In place, tiles and bands would read each other's output
+    if(src->data == dst->data) {
+        Morph_untiled(src, dst, se, op);
+        return;
+    }
+
+    // Line and column passes walk columns and diagonals, which only stay in cache tile by tile.
+    // The row kernels stream whole rows already, they only split into bands for the threads.
+    if(se->rect || se->line_count > 0) {
+        LinesTile lines = {se, op, dst};
+        int hx = se->left > se->right ? se->left : se->right;
+        int hy = se->top > se->bottom ? se->top : se->bottom;
+        Morph_tiled(src, hx, hy, lines_tile, &lines);
+    } else if(ThreadPool_size() > 1) {
+        BandRun band = {se, 1 << op, dst};
+        Morph_bands(src, se->top > se->bottom ? se->top : se->bottom, band_tile, &band);
+    } else {
+        Morph_untiled(src, dst, se, op);
+    }
+}
+
+void Morph_se_border(Plane *src, Plane *dst, const StructElem *se, enum morph_op op, enum border_mode mode, uint8_t value) {
+    if(mode == BORDER_CONSTANT && value == (op == MORPH_MIN ? 255 : 0)) {
+        Morph_se(src, dst, se, op);
+        return;
+    }
+
+    int reach = se->left > se->right ? se->left : se->right;
+    reach = reach > se->top ? reach : se->top;
+    reach = reach > se->bottom ? reach : se->bottom;
+    ON_ERROR_EXIT(src->border < reach, "The border of the plane is narrower than the element");
+    Plane_fill_border(src, reach, mode, value);
+
+    // Over the plane and its border the border pixels count as any other, and the
+    // results inside the plane only reach as far as the border
+    Plane outer = Plane_view(src, -reach, -reach, src->width + 2 * reach, src->height + 2 * reach);
+    if(dst->border >= reach) {
+        Plane outer_dst = Plane_view(dst, -reach, -reach, outer.width, outer.height);
+        Morph_se(&outer, &outer_dst, se, op);
+        dst->filled = 0;
+        return;
+    }
+    Plane result;
+    Scratch_plane(SCRATCH_BORDER, &result, outer.width, outer.height, 0);
+    Morph_se(&outer, &result, se, op);
+    Plane inner = Plane_view(&result, reach, reach, src->width, src->height);
+    Plane_copy(&inner, dst);
+}
+
+void Morph_gradient(const Plane *src, Plane *dst, const StructElem *se) {
+    if(se->line_count == 0 && !se->rect) {
+        if(src->data != dst->data && ThreadPool_size() > 1) {
+            BandRun band = {se, (1 << MORPH_MIN) | (1 << MORPH_MAX), dst};
+            Morph_bands(src, se->top > se->bottom ? se->top : se->bottom, band_tile, &band);
+        } else {
+            Morph_chords(src, dst, se, (1 << MORPH_MIN) | (1 << MORPH_MAX));
+        }
+        return;
+    }
+
+    // Line and rectangle passes have nothing to share between the two extrema
+    Plane min;
+    Scratch_plane(SCRATCH_GRADIENT, &min, src->width, src->height, 0);
+    Morph_se(src, &min, se, MORPH_MIN);
+    Morph_se(src, dst, se, MORPH_MAX);
+    for(int y = 0; y < dst->height; ++y) {
+        uint8_t *out = dst->data + (size_t)y * dst->stride;
+        Kernel_subtract(out, out, min.data + (size_t)y * min.stride, dst->width);
+    }
+}
+
+void Morph_mask(const Plane *src, Plane *dst, const uint8_t *mask, int mask_width, int mask_height, enum morph_op op) {
+    StructElem *se = StructElem_from_mask(mask, mask_width, mask_height);
+    Morph_se(src, dst, se, op);
+    StructElem_free(se);
+}
+
+void Morph_disc(const Plane *src, Plane *dst, int r, enum disc_precision precision, enum morph_op op) {
+    Morph_se(src, dst, StructElem_disc(r, precision), op);
+}
+
+// Where the fused operators put each finished tile
+typedef struct {
+    Plane *dst;         // the result itself
+    int threshold;      // or, from 0 on, src - result binarized at this threshold,
+    uint64_t *bits;     // as bytes in dst or as bits in rows of `words` words
+    int words;
+} TileSink;
+
+static void tile_sink(const TileSink *sink, const Plane *src, const Plane *result, int x, int y) {
+    if(sink->threshold < 0) {
+        Plane out = Plane_view(sink->dst, x, y, result->width, result->height);
+        Plane_copy(result, &out);
+        return;
+    }
+
+    // With the reflected element in its second pass the opening never exceeds its
+    // input, whatever the element, so the difference cannot wrap
+    for(int row = 0; row < result->height; ++row) {
+        const uint8_t *a = src->data + (size_t)(y + row) * src->stride + x;
+        const uint8_t *b = result->data + (size_t)row * result->stride;
+        if(sink->bits == NULL) {
+            Kernel_threshold(a, b, sink->dst->data + (size_t)(y + row) * sink->dst->stride + x, result->width, sink->threshold);
+            continue;
+        }
+
+        // Tiles start on a word boundary, each word is written whole by one tile
+        uint64_t *words = sink->bits + (size_t)(y + row) * sink->words + x / 64;
+        for(int w = 0; w * 64 < result->width; ++w) {
+            int n = result->width - w * 64 < 64 ? result->width - w * 64 : 64;
+            uint8_t mask[64];
+            Kernel_threshold(a + w * 64, b + w * 64, mask, n, sink->threshold);
+            uint64_t word = 0;
+            for(int i = 0; i < n; ++i) {
+                word |= (uint64_t)(mask[i] & 1) << i;
+            }
+            words[w] = word;
+        }
+    }
+}
+
+typedef struct {
+    const Plane *src;
+    const TileSink *sink;
+    const StructElem *se;
+    const StructElem *reflected;    // the element of the second pass
+    enum morph_op first;
+    enum morph_op second;
+} FusedTile;
+
+static void fused_tile(const MorphTile *tile, void *arg) {
+    const FusedTile *fused = arg;
+    const StructElem *se = fused->se;
+    int width = fused->src->width;
+    int height = fused->src->height;
+    int hx = se->left > se->right ? se->left : se->right;
+    int hy = se->top > se->bottom ? se->top : se->bottom;
+
+    // The input reaches twice the reach of the element around the tile, the
+    // second pass only needs the first one within the reach
+    int mx0 = tile->x - hx > 0 ? tile->x - hx : 0;
+    int my0 = tile->y - hy > 0 ? tile->y - hy : 0;
+    int mx1 = tile->x + tile->width + hx < width ? tile->x + tile->width + hx : width;
+    int my1 = tile->y + tile->height + hy < height ? tile->y + tile->height + hy : height;
+
+    Plane first_pass = tile->work;
+    Morph_untiled(&tile->in, &first_pass, se, fused->first);
+
+    Plane second_pass = Plane_view(&first_pass, mx0 - tile->in_x, my0 - tile->in_y, mx1 - mx0, my1 - my0);
+    Morph_untiled(&second_pass, &second_pass, fused->reflected, fused->second);
+
+    Plane result = Plane_view(&second_pass, tile->x - mx0, tile->y - my0, tile->width, tile->height);
+    tile_sink(fused->sink, fused->src, &result, tile->x, tile->y);
+}
+
+static void Morph_fused(const Plane *src, const TileSink *sink, const StructElem *se, enum morph_op first, enum morph_op second) {
+    int hx = se->left > se->right ? se->left : se->right;
+    int hy = se->top > se->bottom ? se->top : se->bottom;
+    // Both passes read the pixels at +(dx, dy): the second one must go back over the
+    // element the first one spread, or an even rectangle shifts the result by a pixel
+    StructElem *reflected = se->symmetric ? NULL : StructElem_reflect(se);
+    FusedTile fused = {src, sink, se, reflected != NULL ? reflected : se, first, second};
+    Morph_tiled(src, 2 * hx, 2 * hy, fused_tile, &fused);
+    StructElem_free(reflected);
+}
+
+void Morph_open(const Plane *src, Plane *dst, const StructElem *se) {
+    TileSink sink = {dst, -1, NULL, 0};
+    Morph_fused(src, &sink, se, MORPH_MIN, MORPH_MAX);
+}
+
+void Morph_close(const Plane *src, Plane *dst, const StructElem *se) {
+    TileSink sink = {dst, -1, NULL, 0};
+    Morph_fused(src, &sink, se, MORPH_MAX, MORPH_MIN);
+}
+
+void Morph_tophat_threshold(const Plane *src, Plane *dst, const StructElem *se, int t) {
+    TileSink sink = {dst, t < 0 ? 0 : t, NULL, 0};
+    Morph_fused(src, &sink, se, MORPH_MIN, MORPH_MAX);
+}
+
+void Morph_tophat_threshold_bits(const Plane *src, uint64_t *bits, int words, const StructElem *se, int t) {
+    TileSink sink = {NULL, t < 0 ? 0 : t, bits, words};
+    Morph_fused(src, &sink, se, MORPH_MIN, MORPH_MAX);
+}
+
+void Morph_open_disc(const Plane *src, Plane *dst, int r, enum disc_precision precision) {
+    Morph_open(src, dst, StructElem_disc(r, precision));
+}
+
+void Morph_close_disc(const Plane *src, Plane *dst, int r, enum disc_precision precision) {
+    Morph_close(src, dst, StructElem_disc(r, precision));
+}
+
+// Pixels queued at one gray level, growing as needed
+typedef struct {
+    Point *data;
+    size_t capacity;
+    size_t count;
+} PixelStack;
+
+static inline void stack_push(PixelStack *stack, int x, int y) {
+    if(stack->count == stack->capacity) {
+        stack->capacity = stack->capacity ? 2 * stack->capacity : 256;
+        stack->data = realloc(stack->data, stack->capacity * sizeof(Point));
+        ON_ERROR_EXIT(stack->data == NULL, "Error in allocating the queue");
+    }
+    Point *p = &stack->data[stack->count++];
+    p->x = x;
+    p->y = y;
+}
+
+// "Below" means lower for a reconstruction by dilation, higher for one by erosion.
+// op and connectivity are constants wherever these are inlined, so each of the four
+// versions of reconstruct compiles without a test of them in its loops.
+static inline __attribute__((always_inline)) bool below(uint8_t a, uint8_t b, enum morph_op op) {
+    return op == MORPH_MAX ? a < b : a > b;
+}
+
+// The higher (lower) of v and n
+static inline __attribute__((always_inline)) uint8_t above_of(uint8_t v, uint8_t n, enum morph_op op) {
+    return below(v, n, op) ? n : v;
+}
+
+static inline __attribute__((always_inline)) void reconstruct(Plane *marker, const Plane *mask, int connectivity, enum morph_op op) {
+    int width = marker->width;
+    int height = marker->height;
+    size_t js = marker->stride;
+    size_t is = mask->stride;
+    bool eight = connectivity == 8;
+
+    // Raster scan: from the left and upper neighbors, held under the mask
+    for(int y = 0; y < height; ++y) {
+        uint8_t *row = marker->data + (size_t)y * js;
+        const uint8_t *up = y > 0 ? row - js : NULL;
+        const uint8_t *in = mask->data + (size_t)y * is;
+        for(int x = 0; x < width; ++x) {
+            uint8_t v = row[x];
+            if(x > 0) {
+                v = above_of(v, row[x - 1], op);
+            }
+            if(up != NULL) {
+                v = above_of(v, up[x], op);
+                if(eight && x > 0) {
+                    v = above_of(v, up[x - 1], op);
+                }
+                if(eight && x < width - 1) {
+                    v = above_of(v, up[x + 1], op);
+                }
+            }
+            row[x] = below(in[x], v, op) ? in[x] : v;
+        }
+    }
+
+    // Anti-raster scan, which also queues the pixels that can still raise (lower) one
+    // of the neighbors it came from, by their value
+    PixelStack levels[256] = {{NULL, 0, 0}};
+    for(int y = height - 1; y >= 0; --y) {
+        uint8_t *row = marker->data + (size_t)y * js;
+        uint8_t *down = y < height - 1 ? row + js : NULL;
+        const uint8_t *in = mask->data + (size_t)y * is;
+        const uint8_t *in_down = down != NULL ? in + is : NULL;
+        for(int x = width - 1; x >= 0; --x) {
+            uint8_t v = row[x];
+            if(x < width - 1) {
+                v = above_of(v, row[x + 1], op);
+            }
+            if(down != NULL) {
+                v = above_of(v, down[x], op);
+                if(eight && x < width - 1) {
+                    v = above_of(v, down[x + 1], op);
+                }
+                if(eight && x > 0) {
+                    v = above_of(v, down[x - 1], op);
+                }
+            }
+            row[x] = v = below(in[x], v, op) ? in[x] : v;
+
+            bool seed = x < width - 1 && below(row[x + 1], v, op) && below(row[x + 1], in[x + 1], op);
+            if(!seed && down != NULL) {
+                seed = (below(down[x], v, op) && below(down[x], in_down[x], op))
+                    || (eight && x < width - 1 && below(down[x + 1], v, op) && below(down[x + 1], in_down[x + 1], op))
+                    || (eight && x > 0 && below(down[x - 1], v, op) && below(down[x - 1], in_down[x - 1], op));
+            }
+            if(seed) {
+                stack_push(&levels[v], x, y);
+            }
+        }
+    }
+
+    // Propagation from the queued pixels, highest first for a dilation, lowest first for
+    // an erosion. A pixel only ever takes the value of the level being processed or its
+    // mask, and later levels cannot raise (lower) it further: it is queued once at most,
+    // besides the seeds it may have been.
+    static const int neighbors[8][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1}};
+    for(int l = 0; l < 256; ++l) {
+        int level = op == MORPH_MAX ? 255 - l : l;
+        PixelStack *stack = &levels[level];
+        while(stack->count > 0) {
+            Point p = stack->data[--stack->count];
+            uint8_t v = marker->data[(size_t)p.y * js + p.x];
+            // Queued again at another level since
+            if(v != level) {
+                continue;
+            }
+            for(int n = 0; n < (eight ? 8 : 4); ++n) {
+                int nx = p.x + neighbors[n][0];
+                int ny = p.y + neighbors[n][1];
+                if(nx < 0 || nx >= width || ny < 0 || ny >= height) {
+                    continue;
+                }
+                uint8_t *j = marker->data + (size_t)ny * js + nx;
+                uint8_t i = mask->data[(size_t)ny * is + nx];
+                if(below(*j, v, op) && *j != i) {
+                    *j = below(i, v, op) ? i : v;
+                    stack_push(&levels[*j], nx, ny);
+                }
+            }
+        }
+        free(stack->data);
+    }
+}
+
+void Morph_reconstruct(Plane *marker, const Plane *mask, int connectivity, enum morph_op op) {
+    if(op == MORPH_MAX) {
+        if(connectivity == 4) {
+            reconstruct(marker, mask, 4, MORPH_MAX);
+        } else {
+            reconstruct(marker, mask, 8, MORPH_MAX);
+        }
+    } else {
+        if(connectivity == 4) {
+            reconstruct(marker, mask, 4, MORPH_MIN);
+        } else {
+            reconstruct(marker, mask, 8, MORPH_MIN);
+        }
+    }
+}
+
+// Marker equal to src on its border and to `inside` everywhere else
+static void border_marker(const Plane *src, Plane *marker, uint8_t inside) {
+    for(int y = 0; y < src->height; ++y) {
+        uint8_t *row = marker->data + (size_t)y * marker->stride;
+        const uint8_t *in = src->data + (size_t)y * src->stride;
+        if(y == 0 || y == src->height - 1) {
+            memcpy(row, in, src->width);
+        } else {
+            memset(row, inside, src->width);
+            row[0] = in[0];
+            row[src->width - 1] = in[src->width - 1];
+        }
+    }
+}
+
+void Morph_fill_holes(const Plane *src, Plane *dst) {
+    border_marker(src, dst, 255);
+    Morph_reconstruct(dst, src, 8, MORPH_MIN);
+}
+
+void Morph_clear_border(const Plane *src, Plane *dst) {
+    border_marker(src, dst, 0);
+    Morph_reconstruct(dst, src, 8, MORPH_MAX);
+    for(int y = 0; y < src->height; ++y) {
+        uint8_t *out = dst->data + (size_t)y * dst->stride;
+        Kernel_subtract(out, src->data + (size_t)y * src->stride, out, src->width);
+    }
+}
+
+void Morph_hmax(const Plane *src, Plane *dst, int h) {
+    for(int y = 0; y < src->height; ++y) {
+        const uint8_t *in = src->data + (size_t)y * src->stride;
+        uint8_t *out = dst->data + (size_t)y * dst->stride;
+        for(int x = 0; x < src->width; ++x) {
+            out[x] = in[x] > h ? in[x] - h : 0;
+        }
+    }
+    Morph_reconstruct(dst, src, 8, MORPH_MAX);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "StructElem.h"
+
+// A single 8-bit plane, consecutive rows are `stride` bytes apart: width plus the
+// borders, rounded up to PLANE_ROW_ALIGNMENT with aligned rows.
+// A padded plane has `border` more pixels allocated on each side, which the operators
+// read instead of testing whether a neighbor is inside. The border is not part of the
+// contents: operators that take a const plane only read a border the caller filled
+// (Plane_fill_border) with the identity of their min/max, Morph_se_border fills its own.
+typedef struct {
+    int width;
+    int height;
+    int stride;
+    uint8_t *data;
+    int border;         // 0 for plain planes and views
+    int filled;         // how far the border holds fill_value, kept for constant fills only
+    uint8_t fill_value;
+    uint8_t *allocation_;   // what Plane_free releases, NULL for views and scratch planes
+} Plane;
+
+// What the pixels outside a plane are taken to be
+enum border_mode {
+    BORDER_CONSTANT,    // a given value
+    BORDER_REPLICATE,   // the nearest pixel of the edge: aaa|abcd
+    BORDER_REFLECT      // mirrored about the edge pixel: cb|abcd
+};
+
+enum morph_op {
+    MORPH_MIN, MORPH_MAX
+};
+
+typedef struct {
+    int x;
+    int y;
+} Point;
+
+// Default side of the square tiles of Morph_tiled
+#define MORPH_TILE_SIZE 1024
+
+// Row alignment of Plane_set_aligned_rows, a cache line and the widest vector
+#define PLANE_ROW_ALIGNMENT 64
+
+// Aligned rows on the calling thread: the planes created or placed from then on start
+// each row on PLANE_ROW_ALIGNMENT bytes, the border before it included, and pad the
+// stride to a multiple of it. Off by default, packed rows. Image_set_aligned_rows sets it.
+void Plane_set_aligned_rows(bool aligned);
+bool Plane_aligned_rows(void);
+
+void Plane_create(Plane *plane, int width, int height);
+void Plane_free(Plane *plane);
+void Plane_copy(const Plane *src, Plane *dst);
+// Plane with `border` pixels allocated around it, free it with Plane_free
+void Plane_create_padded(Plane *plane, int width, int height, int border);
+// Bytes of memory a plane with `border` pixels around it takes, and that plane laid
+// out in `memory`, which must be aligned on PLANE_ROW_ALIGNMENT with aligned rows.
+// Never Plane_free a placed plane.
+size_t Plane_size(int width, int height, int border);
+void Plane_place(Plane *plane, uint8_t *memory, int width, int height, int border);
+// Fill the first `radius` pixels of the border (at most the allocated one) by `mode`,
+// value being used by BORDER_CONSTANT. A constant border already filled that far is
+// left as is, replicated and reflected ones follow the pixels so they are always redone.
+void Plane_fill_border(Plane *plane, int radius, enum border_mode mode, uint8_t value);
+
+// One tile of a tiled run, and the input around it
+typedef struct {
+    int x;          // the tile, in image coordinates
+    int y;
+    int width;
+    int height;
+    Plane in;       // the input over the tile and its halo, clipped to the image
+    int in_x;       // where `in` starts in the image
+    int in_y;
+    Plane work;     // scratch plane the size of `in`, reused from tile to tile
+} MorphTile;
+
+typedef void (*MorphTileFunc)(const MorphTile *tile, void *arg);
+
+// Tiling executor: calls func on every tile of src, with the input extended by
+// halo_x/halo_y pixels on each side. A neighborhood operator whose reach is within
+// the halo gives the same result inside the tile as over the whole image.
+// Tiles are at least four halos wide and a multiple of 64 pixels. They run in
+// parallel over the thread pool, func must only write its own tile of the output.
+// The work plane is scratch memory of the thread: func must not start a tiled run itself.
+void Morph_tiled(const Plane *src, int halo_x, int halo_y, MorphTileFunc func, void *arg);
+// The same with tiles as wide as the image: row bands, two per thread
+void Morph_bands(const Plane *src, int halo_y, MorphTileFunc func, void *arg);
+// Tile side used by Morph_tiled, MORPH_TILE_SIZE unless set
+int Morph_tile_size(void);
+void Morph_set_tile_size(int size);
+
+// Min (erosion) or max (dilation) over the line {i*(dx, dy) : -k <= i <= k}.
+// Lines that go down use the van Herk/Gil-Werman algorithm, 3 comparisons per pixel
+// whatever k is, a whole row at a time on the vector kernel: each row of the running
+// extrema comes from the row dy away shifted by dx. Horizontal lines take spans of
+// doubling length instead, about log2(2k+1) + 1 vector passes over each row: 3.3 ms at
+// k = 1 and 6.8 ms at k = 1000 on 4000x3000. Periodic horizontal ones go through van Herk
+// a gathered line at a time.
+// The dodecagon of radius 43 takes about 30 ms on 4000x3000 this way, against 95 ms for
+// the exact disc through the chord tables (it took 800 ms a pixel at a time).
+// Pixels outside the image are ignored. src and dst may be the same plane.
+void Morph_line(const Plane *src, Plane *dst, int dx, int dy, int k, enum morph_op op);
+
+// Min/max over a structuring element. Elements made of lines run as line passes,
+// elements within 5x5 through the vector row kernel, and any other element through
+// the chord tables of Urbach and Wilkinson: the cost grows with the number of
+// distinct run lengths, not with the area. src and dst may be the same plane.
+void Morph_se(const Plane *src, Plane *dst, const StructElem *se, enum morph_op op);
+
+// The same with the pixels outside src taken from its border, filled by `mode` as far as
+// the element reaches: src must be padded that much. BORDER_CONSTANT with 255 for the min,
+// 0 for the max is the same as Morph_se. src and dst must be different planes.
+void Morph_se_border(Plane *src, Plane *dst, const StructElem *se, enum morph_op op, enum border_mode mode, uint8_t value);
+
+// Morphological gradient, max - min over the element. Not a single pass: the min and
+// the max are two lattices, every table step and run is computed for each. They share
+// the sweep of the rows and one set of chord tables over each row and its complement
+// (the max of the complement is the complement of the min), so each step is one kernel
+// call over both and no erosion or dilation is stored whole. The exact disc of radius 4
+// takes about 13 ms on 4000x3000 against 9 ms for its erosion (16 ms with two sets of
+// tables). Elements made of lines and rectangles take two passes instead.
+// src and dst may be the same plane.
+void Morph_gradient(const Plane *src, Plane *dst, const StructElem *se);
+
+// Min/max over a 0/1 mask of mask_height rows of mask_width bytes, centered on
+// (mask_width/2, mask_height/2). Compiles the mask for this call only.
+void Morph_mask(const Plane *src, Plane *dst, const uint8_t *mask, int mask_width, int mask_height, enum morph_op op);
+
+// Min/max over the disc {(x, y) : x*x + y*y <= r*r}, or its polygonal approximation
+void Morph_disc(const Plane *src, Plane *dst, int r, enum disc_precision precision, enum morph_op op);
+
+// Opening (erosion then dilation) and closing (dilation then erosion).
+// Both passes run tile by tile with a halo, the eroded/dilated image only ever
+// exists one tile at a time. The second pass takes the reflected element, so even
+// sizes and asymmetric masks keep the opening below src and the closing above it.
+// src and dst must be different planes.
+void Morph_open(const Plane *src, Plane *dst, const StructElem *se);
+void Morph_close(const Plane *src, Plane *dst, const StructElem *se);
+void Morph_open_disc(const Plane *src, Plane *dst, int r, enum disc_precision precision);
+void Morph_close_disc(const Plane *src, Plane *dst, int r, enum disc_precision precision);
+
+// White top-hat binarized: src - opening(src) >= t ? 255 : 0, computed tile by tile
+// like the opening, so neither the opening nor the difference is ever stored whole.
+// The _bits version packs the result 64 pixels per word, bit x % 64 of word x / 64
+// of rows of `words` words, and leaves the bits past the width at 0.
+void Morph_tophat_threshold(const Plane *src, Plane *dst, const StructElem *se, int t);
+void Morph_tophat_threshold_bits(const Plane *src, uint64_t *bits, int words, const StructElem *se, int t);
+
+// Morphological reconstruction of marker under mask, in place, with Vincent's hybrid
+// algorithm: one raster and one anti-raster scan, then a propagation of the pixels that
+// can still change. The propagation goes through a queue per gray level rather than a
+// single FIFO, so each pixel is queued at most once (twice for the seeds of the scans):
+// a FIFO changes pixels several times over, 6 on average on noise. MORPH_MAX reconstructs
+// by dilation (marker <= mask), MORPH_MIN by erosion (marker >= mask). connectivity is
+// 4 or 8. Runs in linear time.
+void Morph_reconstruct(Plane *marker, const Plane *mask, int connectivity, enum morph_op op);
+
+// Reconstructions from the border of src, 8-connected. src and dst must be different planes.
+// Fill the holes: the dark regions (minima) not connected to the border
+void Morph_fill_holes(const Plane *src, Plane *dst);
+// Remove the bright regions touching the border
+void Morph_clear_border(const Plane *src, Plane *dst);
+// H-maxima: the maxima lowered by h, the ones less than h deep are flattened
+void Morph_hmax(const Plane *src, Plane *dst, int h);
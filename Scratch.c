@@ -0,0 +1,51 @@
+#define _POSIX_C_SOURCE 200809L
+#include "Scratch.h"
+#include "utils.h"
+#include <pthread.h>
+
+typedef struct {
+    void *data[SCRATCH_SLOTS];
+    size_t size[SCRATCH_SLOTS];
+} ScratchSet;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static void set_free(void *arg) {
+    ScratchSet *set = arg;
+    for(int s = 0; s < SCRATCH_SLOTS; ++s) {
+        free(set->data[s]);
+    }
+    free(set);
+}
+
+static void key_create(void) {
+    ON_ERROR_EXIT(pthread_key_create(&key, set_free) != 0, "Error in creating the scratch key");
+}
+
+static ScratchSet *thread_set(bool create) {
+    pthread_once(&key_once, key_create);
+    ScratchSet *set = pthread_getspecific(key);
+    if(set == NULL && create) {
+        set = calloc(1, sizeof(ScratchSet));
+        ON_ERROR_EXIT(set == NULL || pthread_setspecific(key, set) != 0, "Error in allocating the scratch memory");
+    }
+    return set;
+}
+
+void *Scratch_get(enum scratch_slot slot, size_t size) {
+    ScratchSet *set = thread_set(true);
+    if(set->size[slot] < size) {
+        // Grown without keeping the old contents
+        free(set->data[slot]);
+        set->data[slot] = NULL;
+        set->size[slot] = 0;
+        ON_ERROR_EXIT(posix_memalign(&set->data[slot], 64, size) != 0, "Error in allocating the scratch memory");
+        set->size[slot] = size;
+    }
+    return set->data[slot];
+}
+
+void Scratch_plane(enum scratch_slot slot, Plane *plane, int width, int height, int border) {
+    Plane_place(plane, Scratch_get(slot, Plane_size(width, height, border)), width, height, border);
+}
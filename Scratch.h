@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include "Morphology.h"
+
+// Scratch memory of the operators, one set per thread, kept from call to call.
+// Each slot grows to the largest size asked of it and is never shrunk, so a run of
+// calls on pages of the same size allocates only on the first one. A slot belongs
+// to one function at a time: functions that call each other use different slots.
+enum scratch_slot {
+    SCRATCH_TILE,           // Morph_tiled: the work plane of the worker
+    SCRATCH_LINE,           // Morph_line, periodic horizontal lines
+    SCRATCH_ROW,            // Morph_rect and Morph_line
+    SCRATCH_COLUMN_G,
+    SCRATCH_COLUMN_H,
+    SCRATCH_RING,           // Morph_small and Morph_chords
+    SCRATCH_RING_ROWS,
+    SCRATCH_SECOND_ROW,
+    SCRATCH_GRADIENT,       // Morph_gradient
+    SCRATCH_BORDER,         // Morph_se_border
+    SCRATCH_DISTANCE,       // Distance_*
+    SCRATCH_DISTANCE_ROW,
+    SCRATCH_DISTANCE_V,
+    SCRATCH_DISTANCE_Z,
+    SCRATCH_DISC,           // BinaryImage_erode/dilate
+    SCRATCH_DISC_ROW,
+    SCRATCH_PBM_ROW,        // BinaryImage_load_pbm/save_pbm
+    SCRATCH_STREAM,         // ImageStream_bands
+    SCRATCH_STREAM_WORK,
+    SCRATCH_STREAM_BITS,    // BinaryImage_from_stream_tophat
+    SCRATCH_LUMA,           // Image_* operators
+    SCRATCH_RESULT,
+    SCRATCH_MARKER,
+    SCRATCH_SLOTS
+};
+
+// At least size bytes, aligned on 64 bytes, with whatever the slot held before.
+// Valid until the next call for the same slot on this thread or Scratch_release.
+void *Scratch_get(enum scratch_slot slot, size_t size);
+// Plane of width x height with `border` pixels around it in the memory of the slot.
+// The border is unfilled. Never Plane_free it.
+void Scratch_plane(enum scratch_slot slot, Plane *plane, int width, int height, int border);
+// Bytes held by the calling thread
+size_t Scratch_size(void);
+// Free the scratch memory of the calling thread. The pool threads free theirs when they exit.
+void Scratch_release(void);
@@ -0,0 +1,303 @@
+#include "StructElem.h"
+#include "utils.h"
+#include <math.h>
+#include <pthread.h>
+
+StructElem *StructElem_from_mask(const uint8_t *mask, int width, int height) {
+    StructElem *se = calloc(1, sizeof(StructElem));
+    ON_ERROR_EXIT(se == NULL, "Error in allocating the structuring element");
+    se->width = width;
+    se->height = height;
+    se->mask = malloc((size_t)width * height);
+    se->runs = malloc(((size_t)height * (width + 1) / 2 + 1) * sizeof(SERun));
+    se->lengths = malloc((width + 1) * sizeof(int));
+    int *table_of = calloc(width + 1, sizeof(int));
+    ON_ERROR_EXIT(se->mask == NULL || se->runs == NULL || se->lengths == NULL || table_of == NULL,
+        "Error in allocating the structuring element");
+    memcpy(se->mask, mask, (size_t)width * height);
+    size_t active = 0;
+
+    for(int my = 0; my < height; ++my) {
+        for(int mx = 0; mx < width; ++mx) {
+            if(!mask[my * width + mx]) {
+                continue;
+            }
+            int dx = mx - width / 2;
+            int dy = my - height / 2;
+            ++active;
+
+            if(mx == 0 || !mask[my * width + mx - 1]) {
+                int length = 1;
+                while(mx + length < width && mask[my * width + mx + length]) {
+                    ++length;
+                }
+                se->runs[se->run_count++] = (SERun){dy, dx, length, 0};
+                table_of[length] = 1;
+            }
+
+            se->left = -dx > se->left ? -dx : se->left;
+            se->right = dx > se->right ? dx : se->right;
+            se->top = -dy > se->top ? -dy : se->top;
+            se->bottom = dy > se->bottom ? dy : se->bottom;
+        }
+    }
+
+    // Every length is computed from two overlapping runs of a shorter length,
+    // add the halves that are missing for that
+    table_of[1] = 1;
+    for(int length = width; length > 1; --length) {
+        if(table_of[length]) {
+            bool found = false;
+            for(int shorter = (length + 1) / 2; shorter < length && !found; ++shorter) {
+                found = table_of[shorter];
+            }
+            if(!found) {
+                table_of[(length + 1) / 2] = 1;
+            }
+        }
+    }
+    for(int length = 1; length <= width; ++length) {
+        if(table_of[length]) {
+            table_of[length] = se->length_count;
+            se->lengths[se->length_count++] = length;
+        }
+    }
+    for(int r = 0; r < se->run_count; ++r) {
+        se->runs[r].table = table_of[se->runs[r].length];
+    }
+
+    // A full rectangle is separable
+    se->rect = active == (size_t)width * height;
+
+    // Even sizes put the center off the middle, their reflection falls on other pixels
+    se->symmetric = se->left == se->right && se->top == se->bottom;
+    for(int my = 0; my < height && se->symmetric; ++my) {
+        for(int mx = 0; mx < width && se->symmetric; ++mx) {
+            int ry = 2 * (height / 2) - my;
+            int rx = 2 * (width / 2) - mx;
+            se->symmetric = !mask[my * width + mx] || mask[ry * width + rx];
+        }
+    }
+
+    free(table_of);
+    return se;
+}
+
+StructElem *StructElem_rect(int width, int height) {
+    width = width > 1 ? width : 1;
+    height = height > 1 ? height : 1;
+    uint8_t *mask = malloc((size_t)width * height);
+    ON_ERROR_EXIT(mask == NULL, "Error in allocating the mask");
+    memset(mask, 1, (size_t)width * height);
+    StructElem *se = StructElem_from_mask(mask, width, height);
+    free(mask);
+    return se;
+}
+
+StructElem *StructElem_hline(int length) {
+    return StructElem_rect(length, 1);
+}
+
+StructElem *StructElem_vline(int length) {
+    return StructElem_rect(1, length);
+}
+
+StructElem *StructElem_reflect(const StructElem *se) {
+    // Mask of odd size around the same center, so that nothing shifts
+    int hx = se->left > se->right ? se->left : se->right;
+    int hy = se->top > se->bottom ? se->top : se->bottom;
+    int width = 2 * hx + 1;
+    int height = 2 * hy + 1;
+    uint8_t *mask = calloc((size_t)width * height, 1);
+    ON_ERROR_EXIT(mask == NULL, "Error in allocating the mask");
+    for(int r = 0; r < se->run_count; ++r) {
+        const SERun *run = &se->runs[r];
+        for(int i = 0; i < run->length; ++i) {
+            mask[(size_t)(hy - run->dy) * width + hx - run->dx - i] = 1;
+        }
+    }
+
+    StructElem *reflected = StructElem_from_mask(mask, width, height);
+    free(mask);
+    // The rectangle passes only go by the reach, and lines are their own reflection
+    reflected->rect = se->rect;
+    reflected->line_count = se->line_count;
+    memcpy(reflected->lines, se->lines, se->line_count * sizeof(LineSE));
+    return reflected;
+}
+
+void StructElem_free(StructElem *se) {
+    if(se != NULL) {
+        free(se->mask);
+        free(se->runs);
+        free(se->lengths);
+        free(se);
+    }
+}
+
+// Largest distance between the border of the polygon made by the lines
+// and the circle of radius r, sampled over one octant
+static double lines_error(const LineSE *lines, int count, int r) {
+    double pi = acos(-1.0);
+    double error = 0;
+    for(int s = 0; s <= 45; ++s) {
+        double c = cos(s * pi / 180);
+        double sn = sin(s * pi / 180);
+        double support = 0;
+        for(int l = 0; l < count; ++l) {
+            support += lines[l].k * fabs(lines[l].dx * c + lines[l].dy * sn);
+        }
+        if(fabs(support - r) > error) {
+            error = fabs(support - r);
+        }
+    }
+    return error;
+}
+
+// Decompose the disc of radius r into line elements whose successive min/max
+// gives the octagon or dodecagon closest to the disc. Returns the number of lines.
+static int disc_lines(int r, enum disc_precision precision, LineSE lines[MORPH_MAX_LINES]) {
+    LineSE best[MORPH_MAX_LINES];
+    int count = 0;
+    double best_error = -1;
+
+    // Too small for the periodic lines
+    if(precision == DISC_DODECAGON && r < 7) {
+        precision = DISC_OCTAGON;
+    }
+
+    // The polygon reaches exactly r along the axes, pick the split
+    // between axis and oblique lines that best follows the circle
+    if(precision == DISC_OCTAGON) {
+        count = 4;
+        for(int b = 0; 2 * b <= r; ++b) {
+            int a = r - 2 * b;
+            // Diagonal lines alone leave holes
+            if(b > 0 && a < 1) {
+                break;
+            }
+            LineSE candidate[4] = {{1, 0, a}, {0, 1, a}, {1, 1, b}, {1, -1, b}};
+            double error = lines_error(candidate, count, r);
+            if(best_error < 0 || error < best_error) {
+                best_error = error;
+                memcpy(best, candidate, sizeof(candidate));
+            }
+        }
+    } else if(precision == DISC_DODECAGON) {
+        count = 6;
+        for(int c = 0; 6 * c <= r; ++c) {
+            int a = r - 6 * c;
+            // Same for periodic lines
+            if(c > 0 && a < 1) {
+                break;
+            }
+            LineSE candidate[6] = {{1, 0, a}, {0, 1, a}, {2, 1, c}, {2, -1, c}, {1, 2, c}, {1, -2, c}};
+            double error = lines_error(candidate, count, r);
+            if(best_error < 0 || error < best_error) {
+                best_error = error;
+                memcpy(best, candidate, sizeof(candidate));
+            }
+        }
+    }
+
+    // Lines of length 1 do nothing
+    int n = 0;
+    for(int l = 0; l < count; ++l) {
+        if(best[l].k > 0) {
+            lines[n++] = best[l];
+        }
+    }
+    return n;
+}
+
+// Mask of the sum of the lines, by dilating the center pixel with each line in turn
+static uint8_t *lines_mask(const LineSE *lines, int count, int size) {
+    uint8_t *mask = calloc((size_t)size * size, 1);
+    uint8_t *next = malloc((size_t)size * size);
+    ON_ERROR_EXIT(mask == NULL || next == NULL, "Error in allocating the mask");
+    mask[(size / 2) * size + size / 2] = 1;
+
+    for(int l = 0; l < count; ++l) {
+        memset(next, 0, (size_t)size * size);
+        for(int y = 0; y < size; ++y) {
+            for(int x = 0; x < size; ++x) {
+                if(!mask[y * size + x]) {
+                    continue;
+                }
+                for(int i = -lines[l].k; i <= lines[l].k; ++i) {
+                    int nx = x + i * lines[l].dx;
+                    int ny = y + i * lines[l].dy;
+                    if(nx >= 0 && nx < size && ny >= 0 && ny < size) {
+                        next[ny * size + nx] = 1;
+                    }
+                }
+            }
+        }
+        memcpy(mask, next, (size_t)size * size);
+    }
+
+    free(next);
+    return mask;
+}
+
+static StructElem *disc_build(int r, enum disc_precision precision) {
+    LineSE lines[MORPH_MAX_LINES];
+    int count = precision == DISC_EXACT ? 0 : disc_lines(r, precision, lines);
+
+    // The mask is what the lines cover, or the true disc
+    int size = 2 * r + 1;
+    uint8_t *mask;
+    if(count > 0) {
+        mask = lines_mask(lines, count, size);
+    } else {
+        mask = malloc((size_t)size * size);
+        ON_ERROR_EXIT(mask == NULL, "Error in allocating the mask");
+        for(int y = 0; y < size; ++y) {
+            for(int x = 0; x < size; ++x) {
+                mask[y * size + x] = (x - r) * (x - r) + (y - r) * (y - r) <= r * r;
+            }
+        }
+    }
+
+    StructElem *se = StructElem_from_mask(mask, size, size);
+    se->line_count = count;
+    memcpy(se->lines, lines, count * sizeof(LineSE));
+    free(mask);
+    return se;
+}
+
+// Elements built so far, shared by every caller
+typedef struct CacheEntry {
+    int r;
+    enum disc_precision precision;
+    StructElem *se;
+    struct CacheEntry *next;
+} CacheEntry;
+
+static CacheEntry *cache = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const StructElem *StructElem_disc(int r, enum disc_precision precision) {
+    // A negative radius gives the single pixel element
+    if(r < 0) {
+        r = 0;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    CacheEntry *entry = cache;
+    while(entry != NULL && !(entry->r == r && entry->precision == precision)) {
+        entry = entry->next;
+    }
+    if(entry == NULL) {
+        entry = malloc(sizeof(CacheEntry));
+        ON_ERROR_EXIT(entry == NULL, "Error in allocating the structuring element");
+        entry->r = r;
+        entry->precision = precision;
+        entry->se = disc_build(r, precision);
+        entry->next = cache;
+        cache = entry;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return entry->se;
+}
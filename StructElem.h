@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// How a disc structuring element is executed
+enum disc_precision {
+    DISC_OCTAGON,   // 4 lines: horizontal, vertical and both diagonals
+    DISC_DODECAGON, // 6 lines: horizontal, vertical and the periodic lines (2,1), (2,-1), (1,2), (1,-2),
+                    // octagon below r = 7
+    DISC_EXACT      // the true disc, through its runs
+};
+
+// The line structuring element {i*(dx, dy) : -k <= i <= k}, periodic when |dx| or |dy| > 1
+typedef struct {
+    int dx;
+    int dy;
+    int k;
+} LineSE;
+
+#define MORPH_MAX_LINES 6
+
+// A horizontal run of active pixels: (dx .. dx + length - 1, dy) around the center
+typedef struct {
+    int dy;
+    int dx;
+    int length;
+    int table;  // index in `lengths` of the chord table holding runs of this length
+} SERun;
+
+// Flat structuring element, compiled once into the forms the kernels iterate.
+// Never modified after it is built, so one element can serve any number of threads.
+typedef struct {
+    int width;          // mask size, centered on (width / 2, height / 2)
+    int height;
+    uint8_t *mask;
+    int run_count;
+    SERun *runs;
+    int left;           // how far the runs reach from the center in each direction
+    int right;
+    int top;
+    int bottom;
+    int length_count;   // run lengths with a chord table, each computed from
+    int *lengths;       // two overlapping runs of the previous length
+    int line_count;     // when not 0, the element is the Minkowski sum of these lines
+    LineSE lines[MORPH_MAX_LINES];
+    bool rect;          // the mask is full: a row pass then a column pass
+    bool symmetric;     // equal to its reflection through the center
+} StructElem;
+
+// Element from a 0/1 mask of height rows of width bytes. Free it with StructElem_free.
+StructElem *StructElem_from_mask(const uint8_t *mask, int width, int height);
+void StructElem_free(StructElem *se);
+// The element reflected through its center, every (dx, dy) becoming (-dx, -dy): the
+// kernels read the pixels at +(dx, dy) for both the min and the max, so an opening or
+// closing takes the reflection for its second pass. Free it with StructElem_free.
+StructElem *StructElem_reflect(const StructElem *se);
+
+// Rectangle of width x height pixels, centered like a mask of that size, and the
+// horizontal (length x 1) and vertical (1 x length) lines. Erosion and dilation by
+// them take a row pass of about log2(width) + 1 comparisons per pixel, then a column
+// pass of 3 whatever the height. Free them with StructElem_free.
+StructElem *StructElem_rect(int width, int height);
+StructElem *StructElem_hline(int length);
+StructElem *StructElem_vline(int length);
+
+// The disc {(x, y) : x*x + y*y <= r*r}, or its octagon/dodecagon approximation.
+// Built on first use and cached for the lifetime of the program: never free it.
+const StructElem *StructElem_disc(int r, enum disc_precision precision);
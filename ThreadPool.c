@@ -0,0 +1,134 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ThreadPool.h"
+#include "utils.h"
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct {
+    void (*func)(int task, int worker, void *arg);
+    void *arg;
+    int count;
+    int next;           // next task to hand out, taken atomically
+} Job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+// One job at a time, whatever the number of threads submitting
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t size_once = PTHREAD_ONCE_INIT;
+static int pool_size = 0;
+static int worker_count = 0;
+static pthread_t *workers = NULL;
+static Job job;
+static unsigned generation = 0;
+static int running = 0;         // workers still on the current job
+static bool quitting = false;
+
+// Set in the threads running tasks, to run nested loops inline
+static __thread bool in_task = false;
+
+static void run_tasks(int worker) {
+    in_task = true;
+    for(int task; (task = __atomic_fetch_add(&job.next, 1, __ATOMIC_RELAXED)) < job.count; ) {
+        job.func(task, worker, job.arg);
+    }
+    in_task = false;
+}
+
+static void *worker_main(void *arg) {
+    int worker = (int)(size_t)arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for(;;) {
+        while(generation == seen && !quitting) {
+            pthread_cond_wait(&job_ready, &pool_lock);
+        }
+        if(quitting) {
+            break;
+        }
+        seen = generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_tasks(worker);
+
+        pthread_mutex_lock(&pool_lock);
+        if(--running == 0) {
+            pthread_cond_signal(&job_done);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static void pool_stop(void) {
+    pthread_mutex_lock(&pool_lock);
+    quitting = true;
+    pthread_cond_broadcast(&job_ready);
+    pthread_mutex_unlock(&pool_lock);
+    for(int w = 0; w < worker_count; ++w) {
+        pthread_join(workers[w], NULL);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    quitting = false;
+}
+
+static void size_init(void) {
+    const char *env = getenv("OCR_THREADS");
+    long size = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    pool_size = size >= 1 ? (size < 1024 ? (int)size : 1024) : 1;
+}
+
+int ThreadPool_size(void) {
+    pthread_once(&size_once, size_init);
+    return pool_size;
+}
+
+void ThreadPool_set_size(int size) {
+    pthread_once(&size_once, size_init);
+    pthread_mutex_lock(&submit_lock);
+    pool_stop();
+    pool_size = size >= 1 ? size : 1;
+    pthread_mutex_unlock(&submit_lock);
+}
+
+void ThreadPool_for(int count, void (*func)(int task, int worker, void *arg), void *arg) {
+    if(count <= 1 || in_task || ThreadPool_size() == 1) {
+        for(int task = 0; task < count; ++task) {
+            func(task, 0, arg);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&submit_lock);
+    // Workers start on first use, the caller is worker 0
+    if(worker_count != pool_size - 1) {
+        workers = malloc((pool_size - 1) * sizeof(pthread_t));
+        ON_ERROR_EXIT(workers == NULL, "Error in allocating the thread pool");
+        for(int w = 0; w < pool_size - 1; ++w) {
+            ON_ERROR_EXIT(pthread_create(&workers[w], NULL, worker_main, (void *)(size_t)(w + 1)) != 0,
+                "Error in starting the thread pool");
+        }
+        worker_count = pool_size - 1;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    job = (Job){func, arg, count, 0};
+    running = worker_count;
+    ++generation;
+    pthread_cond_broadcast(&job_ready);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_tasks(0);
+
+    pthread_mutex_lock(&pool_lock);
+    while(running > 0) {
+        pthread_cond_wait(&job_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&submit_lock);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Pool of worker threads the operators split their work over. The calling thread
+// takes part, so a pool of size 1 runs everything on the caller.
+
+// Threads in the pool, caller included. On first use it is OCR_THREADS when that is
+// set in the environment, the number of online processors otherwise.
+int ThreadPool_size(void);
+// Resize the pool, the workers are restarted on next use. Not to be called while a
+// ThreadPool_for is running.
+void ThreadPool_set_size(int size);
+
+// func(task, worker, arg) for every task in [0, count), spread over the pool. worker
+// is in [0, ThreadPool_size()) and no two tasks run at once with the same worker,
+// so it can index per-thread scratch memory. Returns once every task is done.
+// Called from inside a task, the tasks run one after the other on that thread.
+void ThreadPool_for(int count, void (*func)(int task, int worker, void *arg), void *arg);
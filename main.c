@@ -1,61 +1,92 @@
 // Example of using the Image library
 
 #include "Image.h"
+#include "BinaryImage.h"
+#include "ImagePool.h"
 #include "utils.h"
 #include <string.h>
 
+// The stages of the page, each one works on the output of the previous one in memory
+enum stage {
+    STAGE_GRAY, STAGE_TOPHAT, STAGE_OPEN, STAGE_SEED, STAGES
+};
 
+static const char *stage_names[STAGES] = {"gray", "tophat", "open", "seed"};
+// Where a stage is written with -d, the last one always is unless -o says otherwise
+static const char *stage_files[STAGES] = {
+    "Images/output1.png", "Images/output3.png", "Images/output4.png", "Images/output5.png"
+};
+
+// Usage: main <input> [-o <output>] [-d <stage>]...
+// -d writes the output of a stage (gray, tophat, open or seed) for debugging. Without
+// it nothing but the final image goes through a codec after the input is loaded.
 int main(int argc, char *argv[]) {
+    ON_ERROR_EXIT(argc < 2, "Usage: main <input> [-o <output>] [-d <stage>]...");
+    const char *output = stage_files[STAGE_SEED];
+    bool debug[STAGES] = {false};
+    for(int i = 2; i < argc; ++i) {
+        if(!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if(!strcmp(argv[i], "-d") && i + 1 < argc) {
+            ++i;
+            int s = 0;
+            while(s < STAGES && strcmp(argv[i], stage_names[s])) {
+                ++s;
+            }
+            ON_ERROR_EXIT(s == STAGES, "Unknown stage");
+            debug[s] = true;
+        } else {
+            ON_ERROR_EXIT(true, "Usage: main <input> [-o <output>] [-d <stage>]...");
+        }
+    }
 
-    // Convert the images to gray
-    Image img;
-    Image_load(&img, argv[1]);
-    ON_ERROR_EXIT(img.data == NULL, "Error in loading the image");
-    Image img_out;
-    Image_to_gray(&img, &img_out);
-    // Save images
-    Image_save(&img_out, "Images/output1.png");
-    // Release memory
-    Image_free(&img);
-    Image_free(&img_out);
-    
-    // Open
-    Image_load(&img, "Images/output1.png");
-    Image_to_open(&img, &img_out);
-    // Save images
-    Image_save(&img_out, "Images/output2.png");
-    // Release memory
-    Image_free(&img);
-    Image_free(&img_out);
-
-    // Threshold
-    Image orig;
-    Image_load(&orig, "Images/output1.png");
-    Image_load(&img, "Images/output2.png");
-    Threshold(&orig, &img, &img_out, 20);
-    // Save images
-    Image_save(&img_out, "Images/output3.png");
-    // Release memory
-    Image_free(&img);
-    Image_free(&orig);
-    Image_free(&img_out);
+    // The intermediate images of the page share the buffers of a pool
+    ImagePool *pool = ImagePool_create();
+    ImagePool_use(pool);
 
+    // The gray page is only ever whole when it is to be written
+    if(debug[STAGE_GRAY]) {
+        PlanarImage page;
+        PlanarImage_load(&page, argv[1]);
+        ON_ERROR_EXIT(page.luma.data == NULL, "Error in loading the image");
+        PlanarImage_save(&page, stage_files[STAGE_GRAY]);
+        PlanarImage_free(&page);
+    }
+
+    // Top-hat and threshold, packed 64 pixels per word, as the page is decoded: each band
+    // of rows goes through the top-hat while the next one is read and converted to gray
+    ImageStream stream;
+    ON_ERROR_EXIT(!ImageStream_open(&stream, argv[1]), "Error in loading the image");
+    Image img;
+    BinaryImage bin, bin_out;
+    BinaryImage_from_stream_tophat(&stream, &bin, 3, 20);
+    ImageStream_close(&stream);
+    if(debug[STAGE_TOPHAT]) {
+        BinaryImage_to_image(&bin, &img);
+        Image_save(&img, stage_files[STAGE_TOPHAT]);
+        Image_free(&img);
+    }
 
     // Remove noise
-    Image_load(&img, "Images/output3.png");
-    Image_to_open_one(&img, &img_out);
-    // Save images
-    Image_save(&img_out, "Images/output4.png");
-    // Release memory
-    Image_free(&img);
-    Image_free(&img_out);
+    BinaryImage_open(&bin, &bin_out, 1);
+    BinaryImage_free(&bin);
+    Image opened;
+    BinaryImage_to_image(&bin_out, &opened);
+    BinaryImage_free(&bin_out);
+    if(debug[STAGE_OPEN]) {
+        Image_save(&opened, stage_files[STAGE_OPEN]);
+    }
 
     // Empty Image
-    Image_load(&img, "Images/output4.png");
-    Empty_with_pixel(&img, &img_out);
-    // Save images
-    Image_save(&img_out, "Images/output5.png");
+    Image seeded;
+    Empty_with_pixel(&opened, &seeded);
+    Image_save(&seeded, output);
+    if(debug[STAGE_SEED] && strcmp(output, stage_files[STAGE_SEED])) {
+        Image_save(&seeded, stage_files[STAGE_SEED]);
+    }
+
     // Release memory
-    Image_free(&img);
-    Image_free(&img_out);
-}
\ No newline at end of file
+    Image_free(&opened);
+    Image_free(&seeded);
+    ImagePool_destroy(pool);
+}
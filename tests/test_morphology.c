@@ -0,0 +1,473 @@
+// Checks of the Morph_* operators against their definitions, on random planes
+
+#include "../Morphology.h"
+#include "../Kernels.h"
+#include "../ThreadPool.h"
+#include "../utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+do { \
+    if(!(cond)) { \
+        printf("FAIL %s: ", __func__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        ++failures; \
+    } \
+} while(0)
+
+static void random_plane(Plane *plane, int width, int height) {
+    Plane_create(plane, width, height);
+    for(int i = 0; i < width * height; ++i) {
+        plane->data[i] = rand() & 255;
+    }
+}
+
+// Min/max over the line at (x, y), by the definition
+static uint8_t line_window(const Plane *plane, int x, int y, int dx, int dy, int k, enum morph_op op) {
+    uint8_t v = op == MORPH_MIN ? 255 : 0;
+    for(int i = -k; i <= k; ++i) {
+        int nx = x + i * dx;
+        int ny = y + i * dy;
+        if(nx >= 0 && ny >= 0 && nx < plane->width && ny < plane->height) {
+            uint8_t p = plane->data[ny * plane->stride + nx];
+            v = op == MORPH_MIN ? (p < v ? p : v) : (p > v ? p : v);
+        }
+    }
+    return v;
+}
+
+static void test_line(void) {
+    static const int dirs[][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}, {2, 1}, {2, -1}, {1, 2}, {1, -2}, {-1, 0}, {2, 0}, {3, 1}};
+    int count = sizeof(dirs) / sizeof(dirs[0]);
+    for(int t = 0; t < 200; ++t) {
+        Plane src, dst;
+        random_plane(&src, 1 + rand() % 70, 1 + rand() % 70);
+        Plane_create(&dst, src.width, src.height);
+        int d = rand() % count;
+        int k = rand() % 12;
+        enum morph_op op = rand() % 2 ? MORPH_MAX : MORPH_MIN;
+        Morph_line(&src, &dst, dirs[d][0], dirs[d][1], k, op);
+
+        int bad = 0;
+        for(int y = 0; y < src.height; ++y) {
+            for(int x = 0; x < src.width; ++x) {
+                bad += dst.data[y * dst.stride + x] != line_window(&src, x, y, dirs[d][0], dirs[d][1], k, op);
+            }
+        }
+        CHECK(bad == 0, "line (%d, %d) k=%d op=%d on %dx%d: %d pixels differ", dirs[d][0], dirs[d][1], k, op, src.width, src.height, bad);
+
+        Morph_line(&src, &src, dirs[d][0], dirs[d][1], k, op);
+        CHECK(!memcmp(src.data, dst.data, (size_t)src.width * src.height), "line (%d, %d) k=%d in place", dirs[d][0], dirs[d][1], k);
+        Plane_free(&src);
+        Plane_free(&dst);
+    }
+}
+
+// With the border clipped, openings by the line decompositions of a disc must stay
+// below their input and closings above it, the border pixels included
+static void test_open_close_order(void) {
+    for(int t = 0; t < 40; ++t) {
+        Plane src, opened, closed;
+        random_plane(&src, 8 + rand() % 90, 8 + rand() % 90);
+        Plane_create(&opened, src.width, src.height);
+        Plane_create(&closed, src.width, src.height);
+        int r = 1 + rand() % 12;
+        enum disc_precision precision = rand() % 2 ? DISC_DODECAGON : DISC_OCTAGON;
+        Morph_open_disc(&src, &opened, r, precision);
+        Morph_close_disc(&src, &closed, r, precision);
+
+        int above = 0, below = 0;
+        for(int i = 0; i < src.width * src.height; ++i) {
+            above += opened.data[i] > src.data[i];
+            below += closed.data[i] < src.data[i];
+        }
+        CHECK(above == 0, "opening r=%d precision=%d: %d pixels above the input", r, precision, above);
+        CHECK(below == 0, "closing r=%d precision=%d: %d pixels below the input", r, precision, below);
+        Plane_free(&src);
+        Plane_free(&opened);
+        Plane_free(&closed);
+    }
+}
+
+// Min/max of plane over the mask at +(dx, dy) from each pixel, or at -(dx, dy) with
+// reflect, by the definition. The mask is centered on (width / 2, height / 2).
+static void mask_naive(const Plane *src, Plane *dst, const uint8_t *mask, int width, int height, enum morph_op op, bool reflect) {
+    for(int y = 0; y < src->height; ++y) {
+        for(int x = 0; x < src->width; ++x) {
+            uint8_t v = op == MORPH_MIN ? 255 : 0;
+            for(int my = 0; my < height; ++my) {
+                for(int mx = 0; mx < width; ++mx) {
+                    int nx = reflect ? x - (mx - width / 2) : x + mx - width / 2;
+                    int ny = reflect ? y - (my - height / 2) : y + my - height / 2;
+                    if(!mask[my * width + mx] || nx < 0 || ny < 0 || nx >= src->width || ny >= src->height) {
+                        continue;
+                    }
+                    uint8_t p = src->data[ny * src->stride + nx];
+                    v = op == MORPH_MIN ? (p < v ? p : v) : (p > v ? p : v);
+                }
+            }
+            dst->data[y * dst->stride + x] = v;
+        }
+    }
+}
+
+// Openings and closings by elements that are not their own reflection: even
+// rectangles and random masks, against the definition and the order on the input
+static void test_open_close_asymmetric(void) {
+    for(int t = 0; t < 60; ++t) {
+        Plane src, opened, closed, first, expected;
+        random_plane(&src, 1 + rand() % 80, 1 + rand() % 80);
+        if(t == 0) {
+            Plane_free(&src);
+            random_plane(&src, 1000, 50);
+        }
+        int width = t == 0 ? 200 : 1 + rand() % 9;
+        int height = t == 0 ? 1 : 1 + rand() % 9;
+        uint8_t mask[200];
+        for(int i = 0; i < width * height; ++i) {
+            mask[i] = t < 30 || rand() % 3 != 0;
+        }
+        StructElem *se = t < 30 ? StructElem_rect(width, height) : StructElem_from_mask(mask, width, height);
+        Plane_create(&opened, src.width, src.height);
+        Plane_create(&closed, src.width, src.height);
+        Plane_create(&first, src.width, src.height);
+        Plane_create(&expected, src.width, src.height);
+        Morph_open(&src, &opened, se);
+        Morph_close(&src, &closed, se);
+
+        int above = 0, below = 0;
+        for(int i = 0; i < src.width * src.height; ++i) {
+            above += opened.data[i] > src.data[i];
+            below += closed.data[i] < src.data[i];
+        }
+        CHECK(above == 0, "opening by %dx%d on %dx%d: %d pixels above the input", width, height, src.width, src.height, above);
+        CHECK(below == 0, "closing by %dx%d on %dx%d: %d pixels below the input", width, height, src.width, src.height, below);
+
+        mask_naive(&src, &first, mask, width, height, MORPH_MIN, false);
+        mask_naive(&first, &expected, mask, width, height, MORPH_MAX, true);
+        CHECK(!memcmp(opened.data, expected.data, (size_t)src.width * src.height), "opening by %dx%d", width, height);
+        mask_naive(&src, &first, mask, width, height, MORPH_MAX, false);
+        mask_naive(&first, &expected, mask, width, height, MORPH_MIN, true);
+        CHECK(!memcmp(closed.data, expected.data, (size_t)src.width * src.height), "closing by %dx%d", width, height);
+
+        StructElem_free(se);
+        Plane_free(&src);
+        Plane_free(&opened);
+        Plane_free(&closed);
+        Plane_free(&first);
+        Plane_free(&expected);
+    }
+}
+
+// The binarized top-hat against src - opening, which must not wrap for any element
+static void test_tophat(void) {
+    for(int t = 0; t < 30; ++t) {
+        Plane src, opened, mask;
+        random_plane(&src, 1 + rand() % 150, 1 + rand() % 80);
+        Plane_create(&opened, src.width, src.height);
+        Plane_create(&mask, src.width, src.height);
+        uint8_t se_mask[64];
+        int width = 1 + rand() % 8;
+        int height = 1 + rand() % 8;
+        for(int i = 0; i < width * height; ++i) {
+            se_mask[i] = t % 2 == 0 || rand() % 3 != 0;
+        }
+        StructElem *se = StructElem_from_mask(se_mask, width, height);
+        int threshold = rand() % 256;
+        Morph_open(&src, &opened, se);
+        Morph_tophat_threshold(&src, &mask, se, threshold);
+
+        int bad = 0;
+        for(int i = 0; i < src.width * src.height; ++i) {
+            bad += mask.data[i] != (src.data[i] - opened.data[i] >= threshold ? 255 : 0);
+        }
+        CHECK(bad == 0, "top-hat by %dx%d at %d: %d pixels differ", width, height, threshold, bad);
+        StructElem_free(se);
+        Plane_free(&src);
+        Plane_free(&opened);
+        Plane_free(&mask);
+    }
+}
+
+// The gradient against the max and the min by the definition, through the shared tables
+static void test_gradient(void) {
+    for(int t = 0; t < 30; ++t) {
+        Plane src, dst, max, min;
+        random_plane(&src, 1 + rand() % 120, 1 + rand() % 60);
+        Plane_create(&dst, src.width, src.height);
+        Plane_create(&max, src.width, src.height);
+        Plane_create(&min, src.width, src.height);
+        int width = 1 + rand() % 11;
+        int height = 1 + rand() % 11;
+        uint8_t mask[121];
+        for(int i = 0; i < width * height; ++i) {
+            mask[i] = rand() % 4 != 0;
+        }
+        StructElem *se = StructElem_from_mask(mask, width, height);
+        Morph_gradient(&src, &dst, se);
+        mask_naive(&src, &max, mask, width, height, MORPH_MAX, false);
+        mask_naive(&src, &min, mask, width, height, MORPH_MIN, false);
+
+        int bad = 0;
+        for(int i = 0; i < src.width * src.height; ++i) {
+            bad += dst.data[i] != (uint8_t)(max.data[i] - min.data[i]);
+        }
+        CHECK(bad == 0, "gradient by %dx%d on %dx%d: %d pixels differ", width, height, src.width, src.height, bad);
+        StructElem_free(se);
+        Plane_free(&src);
+        Plane_free(&dst);
+        Plane_free(&max);
+        Plane_free(&min);
+    }
+}
+
+// A const src is only read: its border is used when it holds the identity and left as
+// it is otherwise, with the same result as on a plane without a border
+static void test_padded_src(void) {
+    static const uint8_t mask[9] = {0, 1, 0, 1, 1, 1, 0, 1, 1};
+    StructElem *se = StructElem_from_mask(mask, 3, 3);
+    for(int t = 0; t < 20; ++t) {
+        Plane src, padded, expected, dst;
+        random_plane(&src, 1 + rand() % 70, 1 + rand() % 70);
+        Plane_create_padded(&padded, src.width, src.height, 2);
+        Plane_create(&expected, src.width, src.height);
+        Plane_create(&dst, src.width, src.height);
+        enum morph_op op = rand() % 2 ? MORPH_MAX : MORPH_MIN;
+        uint8_t fill = t % 2 ? (op == MORPH_MIN ? 255 : 0) : 7;
+        Plane_fill_border(&padded, 2, BORDER_CONSTANT, fill);
+        Plane_copy(&src, &padded);
+        Morph_se(&src, &expected, se, op);
+        Morph_se(&padded, &dst, se, op);
+        CHECK(!memcmp(dst.data, expected.data, (size_t)src.width * src.height), "padded src op=%d border %d", op, fill);
+
+        int touched = 0;
+        for(int y = -2; y < src.height + 2; ++y) {
+            for(int x = -2; x < src.width + 2; ++x) {
+                bool inside = x >= 0 && y >= 0 && x < src.width && y < src.height;
+                touched += !inside && padded.data[(ptrdiff_t)y * padded.stride + x] != fill;
+            }
+        }
+        CHECK(touched == 0, "padded src op=%d: %d border pixels written", op, touched);
+        Plane_free(&src);
+        Plane_free(&padded);
+        Plane_free(&expected);
+        Plane_free(&dst);
+    }
+    StructElem_free(se);
+}
+
+// Planes with aligned rows start each row on the alignment and give the same results
+static void test_aligned_rows(void) {
+    const StructElem *se = StructElem_disc(3, DISC_EXACT);
+    for(int t = 0; t < 10; ++t) {
+        Plane src, expected, aligned, dst;
+        random_plane(&src, 1 + rand() % 300, 1 + rand() % 100);
+        Plane_create(&expected, src.width, src.height);
+        Morph_open(&src, &expected, se);
+
+        Plane_set_aligned_rows(true);
+        Plane_create_padded(&aligned, src.width, src.height, rand() % 5);
+        Plane_create(&dst, src.width, src.height);
+        Plane_set_aligned_rows(false);
+        CHECK((uintptr_t)aligned.data % PLANE_ROW_ALIGNMENT == 0 && aligned.stride % PLANE_ROW_ALIGNMENT == 0
+            && dst.stride % PLANE_ROW_ALIGNMENT == 0, "aligned rows on %dx%d", src.width, src.height);
+        Plane_copy(&src, &aligned);
+        Morph_open(&aligned, &dst, se);
+        int bad = 0;
+        for(int y = 0; y < src.height; ++y) {
+            bad += memcmp(dst.data + (size_t)y * dst.stride, expected.data + (size_t)y * expected.stride, src.width) != 0;
+        }
+        CHECK(bad == 0, "aligned rows on %dx%d: %d rows differ", src.width, src.height, bad);
+        Plane_free(&src);
+        Plane_free(&expected);
+        Plane_free(&aligned);
+        Plane_free(&dst);
+    }
+}
+
+// What test_simd_levels compares between the levels, on one random input
+static void simd_outputs(const uint8_t *rgba, const Plane *src, const Plane *other, uint8_t *out, int t) {
+    size_t size = (size_t)src->width * src->height;
+    static const uint8_t cross[9] = {0, 1, 0, 1, 1, 1, 0, 1, 0};
+    StructElem *small = StructElem_from_mask(cross, 3, 3);
+    const StructElem *elements[] = {small, StructElem_disc(6, DISC_EXACT), StructElem_disc(9, DISC_DODECAGON)};
+    Plane result = {src->width, src->height, src->width, out, 0, 0, 0, NULL};
+
+    Kernel_gray(rgba, 4, out, (int)size);
+    Kernel_gray(rgba, 3, out + size, (int)size);
+    result.data += 2 * size;
+    Kernel_threshold(src->data, other->data, result.data, (int)size, t);
+    for(int e = 0; e < 3; ++e) {
+        result.data += size;
+        Morph_se(src, &result, elements[e], MORPH_MIN);
+        result.data += size;
+        Morph_se(src, &result, elements[e], MORPH_MAX);
+        result.data += size;
+        Morph_gradient(src, &result, elements[e]);
+    }
+    StructElem_free(small);
+}
+
+// Every instruction set the CPU has gives the same bytes as the scalar kernels
+static void test_simd_levels(void) {
+    enum simd_level saved = Kernels_level();
+    for(int t = 0; t < 10; ++t) {
+        Plane src, other;
+        random_plane(&src, 1 + rand() % 200, 1 + rand() % 40);
+        random_plane(&other, src.width, src.height);
+        size_t size = (size_t)src.width * src.height;
+        uint8_t *rgba = malloc(4 * size);
+        uint8_t *expected = malloc(12 * size);
+        uint8_t *out = malloc(12 * size);
+        for(size_t i = 0; i < 4 * size; ++i) {
+            rgba[i] = rand() & 255;
+        }
+        int threshold = rand() % 256;
+
+        Kernels_set_level(SIMD_SCALAR);
+        simd_outputs(rgba, &src, &other, expected, threshold);
+        for(int level = SIMD_SSE2; level <= (int)Kernels_detect(); ++level) {
+            Kernels_set_level(level);
+            simd_outputs(rgba, &src, &other, out, threshold);
+            CHECK(!memcmp(out, expected, 12 * size), "%s on %dx%d differs from scalar",
+                Kernels_level_name(level), src.width, src.height);
+        }
+        free(rgba);
+        free(expected);
+        free(out);
+        Plane_free(&src);
+        Plane_free(&other);
+    }
+    Kernels_set_level(saved);
+}
+
+// The operators that split into tiles or bands, one after the other into out
+static void tiled_outputs(const Plane *src, const StructElem *se, uint8_t *out) {
+    size_t size = (size_t)src->width * src->height;
+    Plane result = {src->width, src->height, src->width, out, 0, 0, 0, NULL};
+    Morph_se(src, &result, se, MORPH_MIN);
+    result.data += size;
+    Morph_se(src, &result, se, MORPH_MAX);
+    result.data += size;
+    Morph_gradient(src, &result, se);
+    result.data += size;
+    Morph_open(src, &result, se);
+    result.data += size;
+    Morph_close(src, &result, se);
+    result.data += size;
+    Morph_tophat_threshold(src, &result, se, 30);
+}
+
+// One thread and several give the same bytes, with tiles small enough for many
+// tiles and bands, their halos crossing each other
+static void test_threads(void) {
+    int saved_size = ThreadPool_size();
+    int saved_tile = Morph_tile_size();
+    static const uint8_t cross[9] = {0, 1, 0, 1, 1, 1, 0, 1, 1};
+    StructElem *small = StructElem_from_mask(cross, 3, 3);
+    StructElem *rect = StructElem_rect(7, 4);
+    const StructElem *elements[] = {small, rect, StructElem_disc(5, DISC_EXACT), StructElem_disc(9, DISC_DODECAGON)};
+
+    Morph_set_tile_size(64);
+    for(int t = 0; t < 8; ++t) {
+        Plane src;
+        random_plane(&src, 100 + rand() % 300, 100 + rand() % 300);
+        size_t size = (size_t)src.width * src.height;
+        uint8_t *expected = malloc(6 * size);
+        uint8_t *out = malloc(6 * size);
+        const StructElem *se = elements[t % 4];
+
+        ThreadPool_set_size(1);
+        tiled_outputs(&src, se, expected);
+        ThreadPool_set_size(2 + t % 6);
+        tiled_outputs(&src, se, out);
+        for(int o = 0; o < 6; ++o) {
+            CHECK(!memcmp(out + o * size, expected + o * size, size), "operator %d with %d threads on %dx%d",
+                o, ThreadPool_size(), src.width, src.height);
+        }
+        free(expected);
+        free(out);
+        Plane_free(&src);
+    }
+    ThreadPool_set_size(saved_size);
+    Morph_set_tile_size(saved_tile);
+    StructElem_free(small);
+    StructElem_free(rect);
+}
+
+// Reconstruction by the definition: geodesic dilations (erosions) until nothing changes
+static void reconstruct_naive(Plane *marker, const Plane *mask, int connectivity, enum morph_op op) {
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int y = 0; y < marker->height; ++y) {
+            for(int x = 0; x < marker->width; ++x) {
+                uint8_t v = marker->data[y * marker->stride + x];
+                for(int dy = -1; dy <= 1; ++dy) {
+                    for(int dx = -1; dx <= 1; ++dx) {
+                        int nx = x + dx;
+                        int ny = y + dy;
+                        if((connectivity == 4 && dx != 0 && dy != 0) || nx < 0 || ny < 0 || nx >= marker->width || ny >= marker->height) {
+                            continue;
+                        }
+                        uint8_t n = marker->data[ny * marker->stride + nx];
+                        v = op == MORPH_MAX ? (n > v ? n : v) : (n < v ? n : v);
+                    }
+                }
+                uint8_t m = mask->data[y * mask->stride + x];
+                v = op == MORPH_MAX ? (v < m ? v : m) : (v > m ? v : m);
+                if(v != marker->data[y * marker->stride + x]) {
+                    marker->data[y * marker->stride + x] = v;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static void test_reconstruct(void) {
+    for(int t = 0; t < 100; ++t) {
+        Plane mask, marker, expected;
+        random_plane(&mask, 1 + rand() % 60, 1 + rand() % 60);
+        random_plane(&marker, mask.width, mask.height);
+        Plane_create(&expected, mask.width, mask.height);
+        int connectivity = rand() % 2 ? 8 : 4;
+        enum morph_op op = rand() % 2 ? MORPH_MAX : MORPH_MIN;
+        // Smooth the mask a little so regions span more than a pixel
+        Morph_disc(&mask, &expected, 1, DISC_EXACT, op == MORPH_MAX ? MORPH_MIN : MORPH_MAX);
+        Plane_copy(&expected, &mask);
+        for(int i = 0; i < mask.width * mask.height; ++i) {
+            marker.data[i] = op == MORPH_MAX ? (marker.data[i] < mask.data[i] ? marker.data[i] : mask.data[i])
+                                             : (marker.data[i] > mask.data[i] ? marker.data[i] : mask.data[i]);
+            marker.data[i] = rand() % 8 ? (op == MORPH_MAX ? 0 : 255) : marker.data[i];
+        }
+        Plane_copy(&marker, &expected);
+        reconstruct_naive(&expected, &mask, connectivity, op);
+        Morph_reconstruct(&marker, &mask, connectivity, op);
+        CHECK(!memcmp(marker.data, expected.data, (size_t)mask.width * mask.height),
+            "reconstruction op=%d connectivity=%d on %dx%d", op, connectivity, mask.width, mask.height);
+        Plane_free(&mask);
+        Plane_free(&marker);
+        Plane_free(&expected);
+    }
+}
+
+int main(void) {
+    srand(1);
+    test_line();
+    test_open_close_order();
+    test_open_close_asymmetric();
+    test_tophat();
+    test_gradient();
+    test_padded_src();
+    test_aligned_rows();
+    test_simd_levels();
+    test_threads();
+    test_reconstruct();
+    printf(failures ? "%d failures\n" : "All tests passed\n", failures);
+    return failures != 0;
+}
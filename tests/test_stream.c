@@ -0,0 +1,193 @@
+// Checks of ImageStream against the whole-image loader, on generated PNG and PNM files
+
+#define _POSIX_C_SOURCE 200809L
+#include "../ImageStream.h"
+#include "../utils.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+do { \
+    if(!(cond)) { \
+        printf("FAIL %s: ", __func__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        ++failures; \
+    } \
+} while(0)
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void write_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t length) {
+    uint8_t header[8];
+    put_u32(header, length);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(crc32(0, (const Bytef *)type, 4), data, length);
+    uint8_t tail[4];
+    put_u32(tail, (uint32_t)crc);
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, length, file);
+    fwrite(tail, 1, 4, file);
+}
+
+// PNG of random pixels, every row with the given filter or a random one when filter is
+// -1, its compressed data split into IDAT chunks of random sizes
+static void write_png(const char *fname, int width, int height, int depth, int color_type, int filter) {
+    static const int samples_of[7] = {1, 0, 3, 1, 2, 0, 4};
+    size_t line = ((size_t)width * samples_of[color_type] * depth + 7) / 8;
+    int bpp = samples_of[color_type] * depth >= 8 ? samples_of[color_type] * depth / 8 : 1;
+    uint8_t *raw = malloc((line + 1) * height);
+    uint8_t *prev = calloc(line, 1);
+    uint8_t *cur = malloc(line);
+    for(int y = 0; y < height; ++y) {
+        for(size_t i = 0; i < line; ++i) {
+            cur[i] = rand() & 255;
+        }
+        // Indices past the palette would be errors
+        if(color_type == 3 && depth == 8) {
+            for(size_t i = 0; i < line; ++i) {
+                cur[i] &= 15;
+            }
+        }
+        int f = filter >= 0 ? filter : rand() % 5;
+        uint8_t *out = raw + y * (line + 1);
+        out[0] = f;
+        for(size_t i = 0; i < line; ++i) {
+            int a = i >= (size_t)bpp ? cur[i - bpp] : 0;
+            int b = prev[i];
+            int c = i >= (size_t)bpp ? prev[i - bpp] : 0;
+            int p = a + b - c;
+            int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            int predictor[5] = {0, a, b, (a + b) / 2, pa <= pb && pa <= pc ? a : pb <= pc ? b : c};
+            out[1 + i] = cur[i] - predictor[f];
+        }
+        memcpy(prev, cur, line);
+    }
+
+    uLongf size = compressBound((line + 1) * height);
+    uint8_t *packed = malloc(size);
+    compress(packed, &size, raw, (line + 1) * height);
+
+    FILE *file = fopen(fname, "wb");
+    static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    fwrite(signature, 1, 8, file);
+    uint8_t ihdr[13] = {0};
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = depth;
+    ihdr[9] = color_type;
+    write_chunk(file, "IHDR", ihdr, 13);
+    write_chunk(file, "tEXt", (const uint8_t *)"Comment\0test", 12);
+    if(color_type == 3) {
+        uint8_t palette[16 * 3];
+        for(int i = 0; i < 16 * 3; ++i) {
+            palette[i] = rand() & 255;
+        }
+        write_chunk(file, "PLTE", palette, sizeof(palette));
+    }
+    for(uLongf at = 0; at < size;) {
+        uLongf n = 1 + rand() % 300;
+        n = n < size - at ? n : size - at;
+        write_chunk(file, "IDAT", packed + at, n);
+        at += n;
+    }
+    write_chunk(file, "IEND", NULL, 0);
+    fclose(file);
+    free(raw);
+    free(prev);
+    free(cur);
+    free(packed);
+}
+
+// The rows of each band into the whole plane
+static void collect_band(const MorphTile *tile, void *arg) {
+    Plane *luma = arg;
+    for(int y = 0; y < tile->height; ++y) {
+        memcpy(luma->data + (size_t)(tile->y + y) * luma->stride,
+            tile->in.data + (size_t)(tile->y - tile->in_y + y) * tile->in.stride, tile->width);
+    }
+}
+
+// The luma of the stream is that of the loaded image, whatever the band and halo
+static void check_file(const char *fname, const char *what) {
+    Image img;
+    Image_load(&img, fname);
+    CHECK(img.data != NULL, "%s: stb cannot load it", what);
+    if(img.data == NULL) {
+        return;
+    }
+    Plane expected;
+    Image_get_luma(&img, &expected);
+
+    ImageStream stream;
+    CHECK(ImageStream_open(&stream, fname), "%s: cannot open the stream", what);
+    CHECK(stream.file_ != NULL, "%s: decoded whole instead of streamed", what);
+    Plane luma;
+    Plane_create(&luma, stream.width, stream.height);
+    ImageStream_bands(&stream, rand() % 40, rand() % 6, collect_band, &luma);
+    ImageStream_close(&stream);
+
+    int bad = 0;
+    for(int y = 0; y < img.height; ++y) {
+        bad += memcmp(luma.data + (size_t)y * luma.stride, expected.data + (size_t)y * expected.stride, img.width) != 0;
+    }
+    CHECK(bad == 0, "%s: %d rows differ from Image_get_luma", what, bad);
+    Plane_free(&luma);
+    Plane_free(&expected);
+    Image_free(&img);
+}
+
+static void test_png(void) {
+    static const int formats[][2] = {
+        {1, 0}, {2, 0}, {4, 0}, {8, 0}, {16, 0}, {8, 2}, {16, 2},
+        {1, 3}, {2, 3}, {4, 3}, {8, 3}, {8, 4}, {16, 4}, {8, 6}, {16, 6}
+    };
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/tmp/test_stream_%d.png", (int)getpid());
+    for(int t = 0; t < 45; ++t) {
+        int f = t % 15;
+        int width = 1 + rand() % 90;
+        int height = 1 + rand() % 120;
+        write_png(fname, width, height, formats[f][0], formats[f][1], t < 15 ? t % 5 : -1);
+        char what[64];
+        snprintf(what, sizeof(what), "%dx%d depth %d color %d", width, height, formats[f][0], formats[f][1]);
+        check_file(fname, what);
+    }
+    remove(fname);
+}
+
+static void test_pnm(void) {
+    char fname[64];
+    snprintf(fname, sizeof(fname), "/tmp/test_stream_%d.pnm", (int)getpid());
+    for(int t = 0; t < 6; ++t) {
+        int width = 1 + rand() % 90;
+        int height = 1 + rand() % 120;
+        int channels = t % 2 ? 3 : 1;
+        FILE *file = fopen(fname, "wb");
+        fprintf(file, "P%d\n# test\n%d %d\n255\n", channels == 3 ? 6 : 5, width, height);
+        for(int i = 0; i < width * height * channels; ++i) {
+            fputc(rand() & 255, file);
+        }
+        fclose(file);
+        char what[64];
+        snprintf(what, sizeof(what), "%dx%d PNM of %d channels", width, height, channels);
+        check_file(fname, what);
+    }
+    remove(fname);
+}
+
+int main(void) {
+    srand(1);
+    test_png();
+    test_pnm();
+    printf(failures ? "%d failures\n" : "All tests passed\n", failures);
+    return failures != 0;
+}
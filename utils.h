@@ -18,4 +18,28 @@ do { \
 static inline bool str_ends_in(const char *str, const char *ends) {
     char *pos = strrchr(str, '.');
     return !strcmp(pos, ends);
-}
\ No newline at end of file
+}
+
+// Next number of a PBM/PGM/PPM header, skipping the whitespace and the comments, -1 when
+// there is none. Reads the single whitespace after it, so after the last number of the
+// header the file is at the pixels.
+static inline int pnm_number(FILE *file) {
+    int c = fgetc(file);
+    while(c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        if(c == '#') {
+            while(c != '\n' && c != EOF) {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+    if(c < '0' || c > '9') {
+        return -1;
+    }
+    int n = 0;
+    while(c >= '0' && c <= '9' && n < (1 << 24)) {
+        n = n * 10 + c - '0';
+        c = fgetc(file);
+    }
+    return c == EOF || c == ' ' || c == '\t' || c == '\n' || c == '\r' ? n : -1;
+}